@@ -0,0 +1,228 @@
+#include "benchmark.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+using namespace TP;
+
+namespace {
+    const char * modeName(PMConcurrency::SchedulerMode mode) {
+        switch (mode) {
+        case PMConcurrency::SchedulerMode::Asio: return "asio";
+        case PMConcurrency::SchedulerMode::BoundedRing: return "ring";
+        default: return "ws";
+        }
+    }
+
+    std::vector<std::string> split(const std::string & list) {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+
+    bool parseCount(const std::string & text, size_t & value) {
+        char * end = nullptr;
+        unsigned long long parsed = std::strtoull(text.c_str(), &end, 10);
+        if (text.empty() || *end != '\0') {
+            return false;
+        }
+        value = static_cast<size_t>(parsed);
+        return true;
+    }
+
+    struct Stats {
+        double min, median, mean, max, stddev;
+    };
+
+    Stats summarize(std::vector<double> seconds) {
+        Stats stats = { 0, 0, 0, 0, 0 };
+        if (seconds.empty()) {
+            return stats;
+        }
+        std::sort(seconds.begin(), seconds.end());
+        size_t n = seconds.size();
+        stats.min = seconds.front();
+        stats.max = seconds.back();
+        stats.median = n % 2 ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+        stats.mean = std::accumulate(seconds.begin(), seconds.end(), 0.0) / n;
+        double sum = 0;
+        for (double s : seconds) {
+            sum += (s - stats.mean) * (s - stats.mean);
+        }
+        stats.stddev = n > 1 ? std::sqrt(sum / (n - 1)) : 0;
+        return stats;
+    }
+
+    void usage(const char * program) {
+        std::cerr << "usage: " << program << " [--threads=1,2,4] [--modes=asio,ws,ring] [--warmup=N]"
+            << " [--repetitions=N] [--filter=NAME] [--json=FILE|-]" << std::endl;
+    }
+}
+
+bool TP::parseBenchmarkOptions(int argc, char ** argv, BenchmarkOptions & options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+        bool ok = true;
+        if (key == "--threads") {
+            options.threads.clear();
+            for (auto & item : split(value)) {
+                size_t threads = 0;
+                ok = ok && parseCount(item, threads) && threads > 0;
+                options.threads.push_back(threads);
+            }
+        }
+        else if (key == "--modes") {
+            options.modes.clear();
+            for (auto & item : split(value)) {
+                if (item == "asio") {
+                    options.modes.push_back(PMConcurrency::SchedulerMode::Asio);
+                }
+                else if (item == "ws") {
+                    options.modes.push_back(PMConcurrency::SchedulerMode::WorkStealing);
+                }
+                else if (item == "ring") {
+                    options.modes.push_back(PMConcurrency::SchedulerMode::BoundedRing);
+                }
+                else {
+                    ok = false;
+                }
+            }
+        }
+        else if (key == "--warmup") {
+            ok = parseCount(value, options.warmup);
+        }
+        else if (key == "--repetitions") {
+            ok = parseCount(value, options.repetitions) && options.repetitions > 0;
+        }
+        else if (key == "--filter") {
+            options.filter = value;
+        }
+        else if (key == "--json") {
+            ok = !value.empty();
+            options.json = value;
+        }
+        else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (options.threads.empty()) {
+        size_t usable = PMConcurrency::CpuTopology::detect().usable_cpus();
+        for (size_t threads = 1; threads < usable; threads *= 2) {
+            options.threads.push_back(threads);
+        }
+        options.threads.push_back(usable);
+    }
+    if (options.modes.empty()) {
+        options.modes = { PMConcurrency::SchedulerMode::Asio, PMConcurrency::SchedulerMode::WorkStealing };
+    }
+    return true;
+}
+
+std::vector<BenchmarkResult> TP::runBenchmarks(const std::vector<BenchmarkCase> & cases,
+    const BenchmarkOptions & options) {
+    std::vector<BenchmarkResult> results;
+    // With --json=- stdout carries the report alone.
+    std::ostream & table = options.json == "-" ? std::cerr : std::cout;
+    table << std::left << std::setw(40) << "benchmark" << std::right
+        << std::setw(14) << "median ms" << std::setw(14) << "stddev ms" << std::setw(16) << "items/s" << std::endl;
+
+    for (auto & benchmark : cases) {
+        if (!options.filter.empty() && benchmark.name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        for (auto mode : benchmark.uses_pool ? options.modes
+            : std::vector<PMConcurrency::SchedulerMode>(1, options.modes.front())) {
+            for (size_t threads : benchmark.uses_pool ? options.threads : std::vector<size_t>(1, 1)) {
+                BenchmarkResult result;
+                result.name = benchmark.name;
+                result.threads = benchmark.uses_pool ? threads : 0;
+                result.mode = benchmark.uses_pool ? modeName(mode) : "serial";
+                result.items = 0;
+
+                PMConcurrency::ThreadPool pool(threads, mode);
+                pool.start();
+                for (size_t i = 0; i < options.warmup; ++i) {
+                    benchmark.run(pool);
+                }
+                for (size_t i = 0; i < options.repetitions; ++i) {
+                    auto start = std::chrono::steady_clock::now();
+                    result.items = benchmark.run(pool);
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    result.seconds.push_back(elapsed.count());
+                }
+                pool.stop();
+
+                Stats stats = summarize(result.seconds);
+                std::ostringstream label;
+                label << result.name;
+                if (benchmark.uses_pool) {
+                    label << "/threads:" << threads << "/mode:" << result.mode;
+                }
+                table << std::left << std::setw(40) << label.str() << std::right << std::fixed
+                    << std::setprecision(3) << std::setw(14) << stats.median * 1e3
+                    << std::setw(14) << stats.stddev * 1e3
+                    << std::setprecision(0) << std::setw(16) << result.items / stats.median << std::endl;
+                results.push_back(std::move(result));
+            }
+        }
+    }
+    return results;
+}
+
+void TP::writeBenchmarkJson(const std::vector<BenchmarkResult> & results, std::ostream & out) {
+    std::time_t now = std::time(nullptr);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    PMConcurrency::CpuTopology topology = PMConcurrency::CpuTopology::detect();
+
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"usable_cpus\": " << topology.usable_cpus() << ",\n"
+        << "    \"cpu_quota\": " << topology.cpu_quota << ",\n"
+        << "    \"metrics\": " << (PMCONCURRENCY_METRICS ? "true" : "false") << "\n"
+        << "  },\n  \"benchmarks\": [";
+    out << std::setprecision(9) << std::scientific;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult & result = results[i];
+        Stats stats = summarize(result.seconds);
+        out << (i ? "," : "") << "\n    {\n"
+            << "      \"name\": \"" << result.name << "\",\n"
+            << "      \"threads\": " << result.threads << ",\n"
+            << "      \"mode\": \"" << result.mode << "\",\n"
+            << "      \"items\": " << result.items << ",\n"
+            << "      \"repetitions\": " << result.seconds.size() << ",\n"
+            << "      \"min_seconds\": " << stats.min << ",\n"
+            << "      \"median_seconds\": " << stats.median << ",\n"
+            << "      \"mean_seconds\": " << stats.mean << ",\n"
+            << "      \"max_seconds\": " << stats.max << ",\n"
+            << "      \"stddev_seconds\": " << stats.stddev << ",\n"
+            << "      \"items_per_second\": " << (stats.median > 0 ? result.items / stats.median : 0) << ",\n"
+            << "      \"seconds\": [";
+        for (size_t r = 0; r < result.seconds.size(); ++r) {
+            out << (r ? ", " : "") << result.seconds[r];
+        }
+        out << "]\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
@@ -0,0 +1,48 @@
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+#include "ThreadPool.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace TP {
+    // One measured case. `run` does a fixed amount of work on the pool and
+    // returns the number of items it processed, which the harness turns into
+    // items_per_second. Cases with `uses_pool` false run once per sweep,
+    // on a single-thread pool, as a serial baseline.
+    struct BenchmarkCase {
+        std::string name;
+        std::function<std::uint64_t (PMConcurrency::ThreadPool &)> run;
+        bool uses_pool;
+    };
+
+    struct BenchmarkOptions {
+        std::vector<size_t> threads;                      //< empty: 1, 2, 4, ... and CpuTopology::usable_cpus()
+        std::vector<PMConcurrency::SchedulerMode> modes;  //< empty: asio and ws
+        size_t warmup = 1;
+        size_t repetitions = 5;
+        std::string filter;                               //< substring of the case name
+        std::string json;                                 //< file to write, "-" for stdout (the table then goes to stderr)
+    };
+
+    struct BenchmarkResult {
+        std::string name;
+        size_t threads;
+        std::string mode;
+        std::uint64_t items;
+        std::vector<double> seconds; //< one entry per repetition
+    };
+
+    // Parses --threads=1,2,4 --modes=asio,ws,ring --warmup=N --repetitions=N
+    // --filter=S --json=FILE; returns false and prints usage on bad input.
+    bool parseBenchmarkOptions(int argc, char ** argv, BenchmarkOptions & options);
+
+    std::vector<BenchmarkResult> runBenchmarks(const std::vector<BenchmarkCase> & cases,
+        const BenchmarkOptions & options);
+
+    void writeBenchmarkJson(const std::vector<BenchmarkResult> & results, std::ostream & out);
+}
+
+#endif
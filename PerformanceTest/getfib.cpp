@@ -36,88 +36,22 @@ long long getfib::fibonacci(long long n) {
     return fibonacci(n-1) + fibonacci(n-2);
 }
 
-void getfib::getWorkLoad(size_t & workload, size_t & remainload, size_t & iter, 
-  size_t min, size_t count, size_t num_tasks ) {
-
-  size_t load = count / num_tasks;
-  size_t remain = count % num_tasks;
-
-  if ( load < min) {
-    if (count < min) {
-      workload = count;
-      iter = 1;
-      remainload = workload;
-    }
-    else {
-      workload = min;
-      iter = count / workload;
-      remainload = count % workload;
-      if(remainload == 0) {
-        remainload = workload;
-      }
-      else {
-        iter++;
-      }
-    }
-  }
-  else { // load >= MIN
-    workload = load;
-    iter = count / workload;
-    remainload = count % workload;
-    if(remainload == 0) {
-      remainload = workload;
-    }
-    else {
-      iter++;
-    }
-  }
-}
-
 void getfib::run() {
 
   // std::cout << "Using ASIO threadpool for fibonacci." << std::endl;
   startTime();
   // An array of Fibonacci numbers to compute.
-  size_t workload, remainload, iter;
-  getWorkLoad(workload, remainload, iter, 1, _a.size(), _num_tasks);
-  LOG("workload: %d, remainlod: %d, iter: %d", workload, remainload, iter);
-
   _results.resize(_a.size());
 
-  size_t index = 0;
-  for(size_t i = 0; i < iter; i++) {
-    // LOG("%d", index);
-    if (i < iter - 1) {
-      auto self(shared_from_this());
-      addWork( [this, self, workload, index] () {
-          // std::cout << "Start tid: " << _threadPool.getThisThreadId() << std::endl;
-          for (size_t counter = 0; counter < workload; ++counter) {
-              _results[index + counter] = fibonacci(_a[index + counter]);
-          }
-          auto self(shared_from_this());
-          _threadPool.strand( [this, self] () {
-              joinWorks();
-          });
-      });
-      index += workload;
-    }
-    else {
-      auto self(shared_from_this());
-      addWork( [this, self, remainload, index] () {
-          // std::cout << "Start tid: " << _threadPool.getThisThreadId() << std::endl;
-          for (size_t counter = 0; counter < remainload; ++counter) {
-              _results[index + counter] = fibonacci(_a[index + counter]);
-          }
-          auto self(shared_from_this());
-          _threadPool.strand( [this, self] () {
-              joinWorks();
-          });
-      });
-      index += remainload;
-    }
-  }
-
+  PMConcurrency::TraceLabel label("fib chunk");
+  _threadPool.parallel_for( size_t(0), _a.size(), [this] (size_t first, size_t last) {
+      // std::cout << "Start tid: " << _threadPool.getThisThreadId() << std::endl;
+      for (size_t index = first; index < last; ++index) {
+          _results[index] = fibonacci(_a[index]);
+      }
+  });
 
+  joinWorks();
 
   // size_t num_threads = _threadPool.get_thread_size();
 
@@ -146,25 +80,32 @@ void getfib::run() {
 }
 
 void getfib::joinWorks() {
-  --_works;
-  if (_works == 0 ) {
+  for(unsigned long long i : _results) {
+      std::cout << i << std::endl;
+  }
+#if PMCONCURRENCY_HAS_COROUTINES
+  PMConcurrency::sync_wait(finish());
+#else
+  auto self(shared_from_this());
+  _threadPool.enqueue([this, self] () {
+    endTime();
     auto self(shared_from_this());
-    _threadPool.enqueue( [this, self] () {
-      for(unsigned long long i : _results) {
-          std::cout << i << std::endl;
-      }
-      auto self(shared_from_this());
-      _threadPool.enqueue([this, self] () {
-        endTime();
-        auto self(shared_from_this());
-        _threadPool.enqueueMainIoService( [this, self] () {
-          _threadPool.stopMainIoService();
-        });
-      });
+    _threadPool.enqueueMainIoService( [this, self] () {
+      _threadPool.stopMainIoService();
     });
-  }
+  });
+#endif
+}
 
+#if PMCONCURRENCY_HAS_COROUTINES
+PMConcurrency::task<> getfib::finish() {
+  co_await _threadPool.schedule();
+  endTime();
+  _threadPool.enqueueMainIoService([this] () {
+    _threadPool.stopMainIoService();
+  });
 }
+#endif
 
 void getfib::startTime() {
   _start = std::chrono::system_clock::now();
@@ -184,7 +125,7 @@ void getfib::runNativePi(size_t total_count) {
     // std::cout << "Using native multithread with iteration = " << total_count << std::endl;
     // startTime();
 
-    // int num_threads = std::thread::hardware_concurrency() - 1;
+    // size_t num_threads = PMConcurrency::default_thread_count();
 
     // std::vector<std::thread> threads;
     // threads.reserve(num_threads);
@@ -14,8 +14,6 @@ namespace TP {
         void start();
 
     private:
-        void getWorkLoad(size_t & workload, size_t & remainload, size_t & iter,
-            size_t min, size_t count, size_t num_tasks);
         long long fibonacci(long long n);
 
         void run();
@@ -23,14 +21,12 @@ namespace TP {
 
         size_t _total_count;
 
-        template<typename T> // T must be "void handler()""
-        void addWork(T f){
-          _threadPool.enqueue(f);
-          ++_works;
-        }
-
         void joinWorks();
-        int _works = 0;
+
+#if PMCONCURRENCY_HAS_COROUTINES
+        // Times the run on the pool, then stops the main executor.
+        PMConcurrency::task<> finish();
+#endif
 
         void startTime();
         void endTime();
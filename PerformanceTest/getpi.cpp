@@ -1,7 +1,9 @@
 #include "getpi.h"
+#include "pikernel.h"
 #include <random>
 #include <iomanip>
 #include <numeric>
+#include <functional>
 
 #define LOGGER_ENABLED
 #include "logger.h"
@@ -10,7 +12,8 @@ using namespace TP;
 
 getpi::getpi(PMConcurrency::ThreadPool & threadPool, size_t num_tasks, 
   std::function<void (std::string const &)> myFunc)
-  : _threadPool(threadPool), _num_tasks(num_tasks),  _func(myFunc) {
+  : _threadPool(threadPool), _num_tasks(num_tasks),  _func(myFunc), _in_count(threadPool, 0),
+  _graph_total_count(0), _graph_chunks(0), _graph_in_count(0) {
 
   _threadPool.start();
 }
@@ -20,11 +23,18 @@ getpi::~getpi() {
 }
 
 
-void getpi::start() {
-
-    run(1000000000, 1000);
-    // _threadPool.startMainIoService();
-
+void getpi::start(Variant variant) {
+    switch (variant) {
+    case Variant::Graph:
+        runGraph(1000000000, 4 * _num_tasks);
+        break;
+    case Variant::Loop:
+        run(1000000000, 1000);
+        break;
+    case Variant::CounterRng:
+        runCounterRng(1000000000, 1000);
+        break;
+    }
 }
 
 
@@ -88,110 +98,115 @@ void getpi::doCalcs(size_t total_iterations, int & in_count_result) {
 
 // }
 
-void getpi::getWorkLoad(size_t & workload, size_t & remainload, size_t & iter,
-  size_t min, size_t count, size_t num_tasks) {
+void getpi::run(size_t total_count, size_t minload) {
+  // std::cout << "Using ASIO threadpool with iteration = " << total_count << std::endl;
+  startTime();
 
-  size_t load = count / num_tasks;
-  size_t remain = count % num_tasks;
+  _total_count = total_count;
 
-  if ( load < min) {
-    if (count < min) {
-      workload = count;
-      iter = 1;
-      remainload = workload;
-    }
-    else {
-      workload = min;
-      iter = count / workload;
-      remainload = count % workload;
-      if(remainload == 0) {
-        remainload = workload;
-      }
-      else {
-        iter++;
-      }
-    }
-  }
-  else { // load >= MIN
-    workload = load;
-    iter = count / workload;
-    remainload = count % workload;
-    if(remainload == 0) {
-      remainload = workload;
-    }
-    else {
-      iter++;
-    }
-  }
+  _in_count.clear();
+  _threadPool.parallel_for( size_t(0), total_count, [this] (size_t first, size_t last) {
+      // std::cout << "Start tid: " << _threadPool.getThisThreadId() << std::endl;
+      int count = 0;
+      doCalcs( last - first, count);
+      _in_count.local() += count;
+  }, minload);
+
+  joinWorks(_in_count.combine(std::plus<int>()));
 }
 
-void getpi::run(size_t total_count, size_t minload) {
-  // std::cout << "Using ASIO threadpool with iteration = " << total_count << std::endl;
+void getpi::runCounterRng(size_t total_count, size_t minload) {
   startTime();
+  LOG("pi kernel: %s", piKernelName());
 
   _total_count = total_count;
 
-  size_t workload, remainload, iter;
-  getWorkLoad( workload, remainload, iter, minload, total_count, _num_tasks);
-  // getWorkLoad( workload, remainload, iter, minload, total_count, 1000);
-  LOG("workload: %d, remainlod: %d, iter: %d", workload, remainload, iter);
-  
-  _in_count.resize(iter);
-
-  for(size_t i = 0; i < iter; i++) {
-    if (i < iter - 1) {
-      auto self(shared_from_this());
-      addWork( [this, self, workload, i] () {
-          // std::cout << "Start tid: " << _threadPool.getThisThreadId() << std::endl;
-          doCalcs( workload, _in_count[i]);
-          auto self(shared_from_this());
-          _threadPool.strand( [this, self] () {
-              joinWorks();
-          });
-      });
-    }
-    else {
-      auto self(shared_from_this());
-      addWork( [this, self, remainload, i] () {
-          // std::cout << "Start tid: " << _threadPool.getThisThreadId() << std::endl;
-          doCalcs( remainload, _in_count[i]);
-          auto self(shared_from_this());
-          _threadPool.strand( [this, self] () {
-              joinWorks();
-          });
-      });
-    }
-  }
+  size_t in_count = _threadPool.parallel_reduce( size_t(0), total_count, size_t(0),
+    [] (size_t first, size_t last, size_t count) {
+        return count + countInCircle(_rng_seed, first, last);
+    },
+    std::plus<size_t>(), minload);
 
+  joinWorks(in_count);
 }
 
-void getpi::joinWorks() {
-  --_works;
-  if (_works == 0 ) {
-    auto self(shared_from_this());
-    _threadPool.enqueue(
-      [this, self] () {
-        double pi_value = 4.0 * static_cast<double>(std::accumulate(_in_count.begin(), _in_count.end(), 0)) 
-              / static_cast<double>(_total_count);
-        std::cout << "Value of PI is: " << std::fixed << std::setprecision(9) << pi_value 
-        << " at " << _total_count << " iterations " << std::endl;
-        auto self(shared_from_this());
-        _threadPool.enqueue(
-          [this, self] () {
-            endTime();
-            // throw std::runtime_error("getpi throw exception");
-            auto self(shared_from_this());
-            _threadPool.enqueueMainIoService(
-              [this, self] () {
-                _threadPool.stopMainIoService();
-            });
-
-        });
+void getpi::runGraph(size_t total_count, size_t chunks) {
+  if (!_graph || total_count != _graph_total_count || chunks != _graph_chunks) {
+    buildGraph(total_count, chunks);
+  }
+  _total_count = total_count;
+  startTime();
+  LOG("pi kernel: %s", piKernelName());
+  PMConcurrency::TraceLabel label("pi chunk");
+  _graph->run();
+}
 
+void getpi::buildGraph(size_t total_count, size_t chunks) {
+  _graph.reset(new PMConcurrency::TaskGraph(_threadPool));
+  _graph_total_count = total_count;
+  _graph_chunks = chunks;
+  _chunk_counts.assign(std::max<size_t>(chunks, 1), 0);
+
+  PMConcurrency::TaskGraph::NodeId accumulate = _graph->add([this] () {
+    _graph_in_count = std::accumulate(_chunk_counts.begin(), _chunk_counts.end(), size_t(0));
+    double pi_value = 4.0 * static_cast<double>(_graph_in_count) / static_cast<double>(_total_count);
+    std::cout << "Value of PI is: " << std::fixed << std::setprecision(9) << pi_value
+    << " at " << _total_count << " iterations " << std::endl;
+  });
+  PMConcurrency::TaskGraph::NodeId timing = _graph->add([this] () {
+    endTime();
+  });
+  PMConcurrency::ThreadPool & pool = _threadPool;
+  PMConcurrency::TaskGraph::NodeId stop = _graph->add([&pool] () {
+    pool.enqueueMainIoService([&pool] () {
+      pool.stopMainIoService();
+    });
+  });
+
+  size_t per_chunk = total_count / _chunk_counts.size();
+  for (size_t i = 0; i < _chunk_counts.size(); ++i) {
+    size_t first = i * per_chunk;
+    size_t last = i + 1 == _chunk_counts.size() ? total_count : first + per_chunk;
+    PMConcurrency::TaskGraph::NodeId chunk = _graph->add([this, i, first, last] () {
+      _chunk_counts[i] = countInCircle(_rng_seed, first, last);
     });
+    _graph->precede(chunk, accumulate);
   }
+  _graph->precede(accumulate, timing);
+  _graph->precede(timing, stop);
+}
+
+void getpi::joinWorks(size_t in_count) {
+  double pi_value = 4.0 * static_cast<double>(in_count) / static_cast<double>(_total_count);
+  std::cout << "Value of PI is: " << std::fixed << std::setprecision(9) << pi_value 
+  << " at " << _total_count << " iterations " << std::endl;
+#if PMCONCURRENCY_HAS_COROUTINES
+  PMConcurrency::sync_wait(finish());
+#else
+  auto self(shared_from_this());
+  _threadPool.enqueue(
+    [this, self] () {
+      endTime();
+      // throw std::runtime_error("getpi throw exception");
+      auto self(shared_from_this());
+      _threadPool.enqueueMainIoService(
+        [this, self] () {
+          _threadPool.stopMainIoService();
+      });
+
+  });
+#endif
+}
 
+#if PMCONCURRENCY_HAS_COROUTINES
+PMConcurrency::task<> getpi::finish() {
+  co_await _threadPool.schedule();
+  endTime();
+  _threadPool.enqueueMainIoService([this] () {
+    _threadPool.stopMainIoService();
+  });
 }
+#endif
 
 void getpi::startTime() {
   _start = std::chrono::system_clock::now();
@@ -211,7 +226,7 @@ void getpi::runNativePi(size_t total_count) {
     std::cout << "Using native multithread with iteration = " << total_count << std::endl;
     startTime();
 
-    int num_threads = std::thread::hardware_concurrency() - 1;
+    size_t num_threads = PMConcurrency::default_thread_count();
 
     std::vector<std::thread> threads;
     threads.reserve(num_threads);
@@ -2,6 +2,7 @@
 #define _GETPI_H
 
 #include "ThreadPool.h"
+#include <cstdint>
 
 namespace TP {
     class getpi : public std::enable_shared_from_this<getpi> {
@@ -11,25 +12,29 @@ namespace TP {
 
         ~getpi();
 
-        void start();
+        // Graph splits the samples into TaskGraph chunks, Loop uses
+        // parallel_for with std::mt19937, CounterRng parallel_reduce with the
+        // counter-based kernel.
+        enum class Variant { Graph, Loop, CounterRng };
+
+        void start(Variant variant = Variant::Graph);
 
     private:
-        void getWorkLoad(size_t & workload, size_t & remainload, size_t & iter,
-            size_t min, size_t count, size_t num_tasks);
         void doCalcs(size_t total_iterations, int & in_count_result);
         void run(size_t total_count, size_t minload);
+        void runCounterRng(size_t total_count, size_t minload);
         void runNativePi(size_t total_count);
+        void runGraph(size_t total_count, size_t chunks);
+        void buildGraph(size_t total_count, size_t chunks);
 
         size_t _total_count;
 
-        template<typename T> // T must be "void handler()""
-        void addWork(T f){
-          _threadPool.enqueue(f);
-          ++_works;
-        }
+        void joinWorks(size_t in_count);
 
-        void joinWorks();
-        int _works = 0;
+#if PMCONCURRENCY_HAS_COROUTINES
+        // Times the run on the pool, then stops the main executor.
+        PMConcurrency::task<> finish();
+#endif
 
         void startTime();
         void endTime();
@@ -42,7 +47,19 @@ namespace TP {
 
         // // PI
         
-        std::vector<int> _in_count;
+        PMConcurrency::PerWorker<int> _in_count;
+
+        // chunks -> accumulate and print -> endTime -> stop the main loop,
+        // reused by later runGraph() calls with the same arguments.
+        std::unique_ptr<PMConcurrency::TaskGraph> _graph;
+        size_t _graph_total_count;
+        size_t _graph_chunks;
+        std::vector<size_t> _chunk_counts;
+        size_t _graph_in_count;
+
+        // runCounterRng() draws every sample from a fixed key, so its result
+        // can be checked across runs and thread counts.
+        static const std::uint32_t _rng_seed = 20170301;
 
         size_t _num_tasks;
 
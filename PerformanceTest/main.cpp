@@ -1,105 +1,34 @@
-#include <random>
-#include <iomanip>
-#include <numeric>
+#include <array>
 #include <chrono>
-#include <vector>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <thread>
+#include <vector>
 
-#ifdef MSVC
-#include <concurrent_vector.h>
-#include <ppl.h>
-#endif
-
+#include "benchmark.h"
+#include "pikernel.h"
 #include "getpi.h"
 #include "getfib.h"
 
-
-
-
-void doCalcs(size_t total_iterations, int & in_count_result) {
-    auto seed = std::random_device{}();
-    auto gen = std::mt19937{ seed };
-    auto dist = std::uniform_real_distribution<>{0, 1};
-
-    auto in_count{ 0 };
-
-    //calculation
-    for (auto counter = 0; counter < total_iterations; ++counter) {
-        auto x = dist(gen);
-        auto y = dist(gen);
-        auto result = std::sqrt(std::pow(x, 2) + std::pow(y, 2));
-        if (result < 1) {
-            ++in_count; //check if the generated value is inside a unit circle
-        }
-    }
-
-    in_count_result = in_count;
-}
-
-void getpi(size_t total_count) {
-
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-
-    start = std::chrono::system_clock::now();
-
-    int num_threads = std::thread::hardware_concurrency() - 1;
-
-    std::vector<std::thread> threads;
-    threads.reserve(num_threads);
-
-    std::vector<int> in_count;
-    in_count.resize(num_threads);
-
-    for (size_t i = 0; i < num_threads; ++i) {
-        size_t total_iterations = total_count / num_threads;
-        if (i == 0) {
-            total_iterations += total_count % num_threads; // get the remaining iterations calculated by thread 0
-        }
-
-        // threads.emplace_back(doCalcs, total_iterations, std::ref(in_count[i]));
-        threads.emplace_back( [total_iterations, i, &in_count] () {
-            doCalcs(total_iterations, in_count[i]);
-        });
-    }
-
-    for (auto & thread : threads) {
-        if (thread.joinable()) {
-            thread.join();
-        }
-    }
-
-    double pi_value = 4.0 * static_cast<double>(std::accumulate(in_count.begin(), in_count.end(), 0)) 
-        / static_cast<double>(total_count);
-    // std::cout << "Value of PI is: " << pi_value << std::endl;
-    std::cout << "Value of PI is: " << std::fixed << std::setprecision(9) << pi_value 
-    << " at " << total_count << " iterations " << std::endl;
-
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Time used (multithread) : " << elapsed_seconds.count() << " sec" << std::endl;
+// Fixed workload sizes, so that runs of different builds can be compared.
+namespace {
+    const size_t empty_tasks = 200000;
+    const size_t round_trips = 20000;
+    const size_t fan_rounds = 1000;
+    const size_t fan_width = 64;
+    const size_t strand_posts = 200000;
+    const size_t sessions = 1000;
+    const size_t timeouts = 100000;
+    const size_t tree_depth = 14;       //< 2^15 - 1 tasks
+    const int fork_join_n = 30;
+    const int fork_join_cutoff = 12;
+    const size_t pi_samples = 100000000;
+    const std::uint32_t pi_seed = 20170301;
+    const std::vector<int> fib_inputs = { 30, 31, 32, 33, 34, 35, 36, 37 };
 }
 
-void getpi_serial(size_t total_count) {
-
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-
-    start = std::chrono::system_clock::now();
-
-    int count = 0;
-
-    doCalcs(total_count, count);
-
-    double pi_value = 4.0 * static_cast<double>(count) / static_cast<double>(total_count);
-    // std::cout << "Value of PI is: " << pi_value << std::endl;
-    std::cout << "Value of PI is: " << std::fixed << std::setprecision(9) << pi_value 
-    << " at " << total_count << " iterations " << std::endl;
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Time used (serial) : " << elapsed_seconds.count() << " sec" << std::endl;
-}
-
-
 // Computes the nth Fibonacci number.
 long long fibonacci(long long n) {
     if(n < 2) {
@@ -108,156 +37,306 @@ long long fibonacci(long long n) {
     return fibonacci(n-1) + fibonacci(n-2);
 }
 
-void getfibonacci() {
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    start = std::chrono::system_clock::now();   
-
-    // An array of Fibonacci numbers to compute.
-    std::vector<int> a = { 41, 42, 43, 44, 45, 46, 47, 48};
-
-    int num_threads = std::thread::hardware_concurrency() - 1;
+void spawnTree(PMConcurrency::TaskGroup & group, size_t depth) {
+    if (depth == 0) {
+        return;
+    }
+    group.run([&group, depth] () {
+        spawnTree(group, depth - 1);
+        spawnTree(group, depth - 1);
+    });
+}
 
-    std::vector<std::thread> threads;
-    threads.reserve(num_threads);
+// Fork-join fibonacci: each task waits on a future for its first half,
+// running queued tasks meanwhile rather than blocking its worker.
+long long forkJoinFib(PMConcurrency::ThreadPool & pool, int n, std::uint64_t & tasks) {
+    if (n < fork_join_cutoff) {
+        return fibonacci(n);
+    }
+    std::uint64_t left_tasks = 0;
+    PMConcurrency::Future<long long> left = pool.submit([&pool, &left_tasks, n] () {
+        return forkJoinFib(pool, n - 1, left_tasks);
+    });
+    long long right = forkJoinFib(pool, n - 2, tasks);
+    long long result = left.get() + right;
+    tasks += left_tasks + 1;
+    return result;
+}
 
-    std::vector<unsigned long long> results;
-    results.resize(a.size());
+std::vector<TP::BenchmarkCase> benchmarkCases() {
+    using PMConcurrency::ThreadPool;
+    std::vector<TP::BenchmarkCase> cases;
 
-    size_t index = 0;
-    for (size_t i = 0; i < num_threads && index < a.size() ; ++i) {
-        size_t total_iterations = a.size() / num_threads;
-        if (i == 0) {
-            total_iterations += a.size() % num_threads; // get the remaining iterations calculated by thread 0
+    // Enqueue cost plus the cheapest possible fan-in.
+    cases.push_back({ "empty_task", [] (ThreadPool & pool) -> std::uint64_t {
+        PMConcurrency::TaskGroup group(pool);
+        for (size_t i = 0; i < empty_tasks; ++i) {
+            group.run([] () {});
         }
-
-        threads.emplace_back( [&a, &results, total_iterations, index] () {
-            for (auto counter = 0; counter < total_iterations; ++counter) {
-                results[index + counter] = fibonacci(a[index + counter]);
+        group.wait();
+        return empty_tasks;
+    }, true });
+
+    // The same tasks published in one enqueue_n() batch.
+    cases.push_back({ "empty_task_bulk", [] (ThreadPool & pool) -> std::uint64_t {
+        std::atomic<size_t> remaining(empty_tasks);
+        std::promise<void> finished;
+        pool.enqueue_n(empty_tasks, [&remaining, &finished] (size_t) {
+            return [&remaining, &finished] () {
+                if (remaining.fetch_sub(1) == 1) {
+                    finished.set_value();
+                }
+            };
+        });
+        finished.get_future().wait();
+        return empty_tasks;
+    }, true });
+
+    // Closures too big for a Task's inline storage: allocated by the caller
+    // and freed by whichever worker ran them.
+    cases.push_back({ "heap_task", [] (ThreadPool & pool) -> std::uint64_t {
+        PMConcurrency::TaskGroup group(pool);
+        std::array<std::uint64_t, 12> payload = {};
+        for (size_t i = 0; i < empty_tasks; ++i) {
+            group.run([payload] () {
+                volatile std::uint64_t sink = payload[0];
+                (void)sink;
+            });
+        }
+        group.wait();
+        return empty_tasks;
+    }, true });
+
+    // One submit() and get() at a time: the wake-up latency of an idle pool.
+    cases.push_back({ "submit_latency", [] (ThreadPool & pool) -> std::uint64_t {
+        for (size_t i = 0; i < round_trips; ++i) {
+            pool.submit([] () { return 0; }).get();
+        }
+        return round_trips;
+    }, true });
+
+    cases.push_back({ "fan_out_fan_in", [] (ThreadPool & pool) -> std::uint64_t {
+        for (size_t round = 0; round < fan_rounds; ++round) {
+            PMConcurrency::TaskGroup group(pool);
+            for (size_t i = 0; i < fan_width; ++i) {
+                group.run([] () {
+                    volatile long long sink = fibonacci(12);
+                    (void)sink;
+                });
+            }
+            group.wait();
+        }
+        return fan_rounds * fan_width;
+    }, true });
+
+    // fan_out_fan_in as one prebuilt graph, rerun every round.
+    cases.push_back({ "task_graph", [] (ThreadPool & pool) -> std::uint64_t {
+        PMConcurrency::TaskGraph graph(pool);
+        PMConcurrency::TaskGraph::NodeId source = graph.add([] () {});
+        PMConcurrency::TaskGraph::NodeId sink = graph.add([] () {});
+        for (size_t i = 0; i < fan_width; ++i) {
+            PMConcurrency::TaskGraph::NodeId node = graph.add([] () {
+                volatile long long sink = fibonacci(12);
+                (void)sink;
+            });
+            graph.precede(source, node);
+            graph.precede(node, sink);
+        }
+        for (size_t round = 0; round < fan_rounds; ++round) {
+            graph.run();
+        }
+        return fan_rounds * fan_width;
+    }, true });
+
+    cases.push_back({ "strand", [] (ThreadPool & pool) -> std::uint64_t {
+        size_t count = 0;
+        std::promise<void> finished;
+        for (size_t i = 0; i < strand_posts; ++i) {
+            pool.strand([&count, &finished] () {
+                if (++count == strand_posts) {
+                    finished.set_value();
+                }
+            });
+        }
+        finished.get_future().wait();
+        return strand_posts;
+    }, true });
+
+    // The strand workload spread over independent per-session executors,
+    // which may run in parallel.
+    cases.push_back({ "serial_executors", [] (ThreadPool & pool) -> std::uint64_t {
+        std::vector<std::shared_ptr<PMConcurrency::SerialExecutor>> executors;
+        for (size_t i = 0; i < sessions; ++i) {
+            executors.push_back(pool.make_serial_executor());
+        }
+        std::atomic<size_t> remaining(strand_posts);
+        std::promise<void> finished;
+        for (size_t i = 0; i < strand_posts; ++i) {
+            executors[i % sessions]->enqueue([&remaining, &finished] () {
+                if (remaining.fetch_sub(1) == 1) {
+                    finished.set_value();
+                }
+            });
+        }
+        finished.get_future().wait();
+        return strand_posts;
+    }, true });
+
+    // Completions marshalled back to one consumer thread, which drains them
+    // in batches as a service loop would.
+    cases.push_back({ "main_handoff", [] (ThreadPool & pool) -> std::uint64_t {
+        PMConcurrency::MainExecutor main;
+        size_t count = 0;
+        pool.enqueue_n(strand_posts, [&main, &count] (size_t) {
+            return [&main, &count] () {
+                main.post([&main, &count] () {
+                    if (++count == strand_posts) {
+                        main.stop();
+                    }
+                });
+            };
+        });
+        main.run();
+        return strand_posts;
+    }, true });
+
+    // Request timeouts: armed, then cancelled before they fire.
+    cases.push_back({ "timer_arm_cancel", [] (ThreadPool & pool) -> std::uint64_t {
+        std::vector<PMConcurrency::TimerHandle> handles;
+        handles.reserve(timeouts);
+        for (size_t i = 0; i < timeouts; ++i) {
+            handles.push_back(pool.schedule_after(std::chrono::seconds(30), [] () {}));
+        }
+        for (auto & handle : handles) {
+            handle.cancel();
+        }
+        return timeouts;
+    }, true });
+
+    // Tasks spawned from inside other tasks, as a recursive divide and conquer does.
+    cases.push_back({ "nested_submit", [] (ThreadPool & pool) -> std::uint64_t {
+        PMConcurrency::TaskGroup group(pool);
+        spawnTree(group, tree_depth + 1);
+        group.wait();
+        return (size_t(1) << (tree_depth + 1)) - 1;
+    }, true });
+
+    cases.push_back({ "nested_wait", [] (ThreadPool & pool) -> std::uint64_t {
+        std::uint64_t tasks = 0;
+        volatile long long sink = pool.submit([&pool, &tasks] () {
+            return forkJoinFib(pool, fork_join_n, tasks);
+        }).get();
+        (void)sink;
+        return tasks;
+    }, true });
+
+    cases.push_back({ "pi", [] (ThreadPool & pool) -> std::uint64_t {
+        volatile size_t in_count = pool.parallel_reduce(size_t(0), pi_samples, size_t(0),
+            [] (size_t first, size_t last, size_t count) {
+                return count + TP::countInCircle(pi_seed, first, last);
+            },
+            std::plus<size_t>(), 1000);
+        (void)in_count;
+        return pi_samples;
+    }, true });
+
+    cases.push_back({ "pi_serial", [] (ThreadPool &) -> std::uint64_t {
+        volatile size_t in_count = TP::countInCircle(pi_seed, 0, pi_samples);
+        (void)in_count;
+        return pi_samples;
+    }, false });
+
+    cases.push_back({ "fib", [] (ThreadPool & pool) -> std::uint64_t {
+        std::vector<long long> results(fib_inputs.size());
+        pool.parallel_for(size_t(0), fib_inputs.size(), [&results] (size_t first, size_t last) {
+            for (size_t index = first; index < last; ++index) {
+                results[index] = fibonacci(fib_inputs[index]);
             }
         });
-        // std::cout << i << ":" << index << ":" << total_iterations << std::endl;
-        index += total_iterations;
-        
-    }
+        return fib_inputs.size();
+    }, true });
 
-    for (auto & thread : threads) {
-        if (thread.joinable()) {
-            thread.join();
+    cases.push_back({ "fib_serial", [] (ThreadPool &) -> std::uint64_t {
+        volatile long long sink = 0;
+        for (int n : fib_inputs) {
+            sink = sink + fibonacci(n);
         }
-    }
+        return fib_inputs.size();
+    }, false });
 
-    for(unsigned long long i : results) {
-        std::cout << i << std::endl;
-    }
-
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Time used (multithread) : " << elapsed_seconds.count() << " sec" << std::endl;
+    return cases;
 }
 
-void getfibonacci_serial() {
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    start = std::chrono::system_clock::now();   
-
-    // An array of Fibonacci numbers to compute.
-    std::vector<int> a = { 41, 42, 43, 44, 45, 46, 47, 48 };
+// The original end-to-end runs, driven by the main executor. With a trace
+// file, every task run is written to it in Chrome trace format.
+int runDemo(const std::string & which, const std::string & trace) {
+    std::function<void (std::string const &)> func =
+      [] (std::string const & result) {
+        std::cout << result << std::endl;
+    };
 
-    std::vector<unsigned long long> results(a.size());
-    for (size_t i = 0; i < a.size() ; ++i) {
-        results[i] = fibonacci(a[i]);
-        // std::cout << i << ":" << index << ":" << total_iterations << std::endl;
+    PMConcurrency::ThreadPoolOptions options;
+    if (!trace.empty()) {
+        options.trace_capacity = 1 << 16;
     }
+    PMConcurrency::ThreadPool threadPool(options);
 
-    for(unsigned long long i : results) {
-        std::cout << i << std::endl;
+    if (which == "pi" || which == "pi-loop" || which == "pi-rng") {
+        std::shared_ptr<TP::getpi> myGetPi = std::make_shared<TP::getpi>(threadPool, threadPool.get_thread_size(), func);
+        myGetPi->start(which == "pi" ? TP::getpi::Variant::Graph
+            : which == "pi-loop" ? TP::getpi::Variant::Loop : TP::getpi::Variant::CounterRng);
+    }
+    else if (which == "fib") {
+        std::shared_ptr<TP::getfib> myGetFib = std::make_shared<TP::getfib>(threadPool, threadPool.get_thread_size(), func);
+        myGetFib->start();
+    }
+    else {
+        std::cerr << "unknown demo: " << which << std::endl;
+        return 1;
     }
 
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Time used (serial): " << elapsed_seconds.count() << " sec" << std::endl;
-}
-
-#ifdef MSVC
-void getpi_ppl(size_t total_count, size_t num_tasks = std::thread::hardware_concurrency() - 1) {
-
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-
-    start = std::chrono::system_clock::now();
-
-    // size_t num_threads = std::thread::hardware_concurrency() - 1;
-    // size_t num_threads = 1000;
-
-    std::vector<int> in_count;
-    in_count.resize(num_tasks);
+    threadPool.startMainIoService();
 
-    concurrency::parallel_for( (size_t) 0, num_tasks, [total_count, num_tasks, &in_count] (size_t i) {
-        size_t total_iterations = total_count / num_tasks;
-        if (i == 0) {
-            total_iterations += total_count % num_tasks; // get the remaining iterations calculated by thread 0
+    if (!trace.empty()) {
+        std::ofstream out(trace);
+        threadPool.write_chrome_trace(out);
+        if (!out) {
+            std::cerr << "cannot write " << trace << std::endl;
+            return 1;
         }
-        doCalcs(total_iterations, in_count[i]);
-    });
-
-    double pi_value = 4.0 * static_cast<double>(std::accumulate(in_count.begin(), in_count.end(), 0)) 
-        / static_cast<double>(total_count);
-    // std::cout << "Value of PI is: " << pi_value << std::endl;
-    std::cout << "Value of PI is: " << std::fixed << std::setprecision(9) << pi_value 
-    << " at " << total_count << " iterations " << std::endl;
-
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Time used (ppl): " << elapsed_seconds.count() << " sec" << std::endl;
-}
-
-void getfibonacci_ppl() {
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    start = std::chrono::system_clock::now();   
-
-    // An array of Fibonacci numbers to compute.
-    std::vector<int> a = { 41, 42, 43, 44, 45, 46, 47, 48};
-
-    // concurrency::concurrent_vector<unsigned long long> results;
-    std::vector<unsigned long long> results;
-    results.resize(a.size());
-
-    concurrency::parallel_for( (size_t) 0, a.size(), [&] (size_t i) {
-        results[i] = fibonacci(a[i]);
-    });
-
-
-    for(unsigned long long i : results) {
-        std::cout << i << std::endl;
     }
-
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end - start;
-    std::cout << "Time used (ppl): " << elapsed_seconds.count() << " sec" << std::endl;
+    return 0;
 }
-#endif
-
-int main() {
-
-    // getpi_serial(1000000000);
-    // getpi(1000000000);
-    // getpi_ppl(1000000000);
-    
-    // getfibonacci_serial();
-    // getfibonacci();
-    // getfibonacci_ppl();
-    
-    std::function<void (std::string const &)> func = 
-      [] (std::string const & result) {
-        std::cout << result << std::endl;
-    };
 
-    PMConcurrency::ThreadPool threadPool;
+int main(int argc, char ** argv) {
+    if (argc >= 2 && std::strncmp(argv[1], "--demo=", 7) == 0) {
+        if (argc == 2) {
+            return runDemo(argv[1] + 7, std::string());
+        }
+        if (argc == 3 && std::strncmp(argv[2], "--trace=", 8) == 0) {
+            return runDemo(argv[1] + 7, argv[2] + 8);
+        }
+        std::cerr << "usage: " << argv[0] << " --demo=pi|pi-loop|pi-rng|fib [--trace=FILE]" << std::endl;
+        return 1;
+    }
 
-    // std::shared_ptr<TP::getpi> myGetPi = std::make_shared<TP::getpi>(threadPool, threadPool.get_thread_size(), func);
-    // myGetPi->start();
+    TP::BenchmarkOptions options;
+    if (!TP::parseBenchmarkOptions(argc, argv, options)) {
+        return 1;
+    }
 
-    std::shared_ptr<TP::getfib> myGetFib = std::make_shared<TP::getfib>(threadPool, threadPool.get_thread_size(), func);
-    myGetFib->start();
+    std::vector<TP::BenchmarkResult> results = TP::runBenchmarks(benchmarkCases(), options);
 
-    threadPool.startMainIoService();
+    if (options.json == "-") {
+        TP::writeBenchmarkJson(results, std::cout);
+    }
+    else if (!options.json.empty()) {
+        std::ofstream out(options.json);
+        TP::writeBenchmarkJson(results, out);
+        if (!out) {
+            std::cerr << "cannot write " << options.json << std::endl;
+            return 1;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
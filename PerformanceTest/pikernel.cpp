@@ -0,0 +1,169 @@
+#include "pikernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIKERNEL_X86
+#include <immintrin.h>
+#endif
+
+using namespace TP;
+
+namespace {
+
+  // Philox2x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+  const std::uint32_t philox_m = 0xD256D193;
+  const std::uint32_t philox_w = 0x9E3779B9;
+  const int philox_rounds = 10;
+
+  // x and y keep 31 bits each, so x*x + y*y fits in 64 bits and the test
+  // against the squared radius is exact.
+  const std::uint64_t radius_squared = 1ull << 62;
+
+  inline bool sampleInCircle(std::uint32_t key, std::uint64_t counter) {
+    std::uint32_t c0 = static_cast<std::uint32_t>(counter);
+    std::uint32_t c1 = static_cast<std::uint32_t>(counter >> 32);
+    for (int round = 0; round < philox_rounds; ++round) {
+      std::uint64_t product = static_cast<std::uint64_t>(philox_m) * c0;
+      c0 = static_cast<std::uint32_t>(product >> 32) ^ key ^ c1;
+      c1 = static_cast<std::uint32_t>(product);
+      key += philox_w;
+    }
+    std::uint64_t x = c0 >> 1;
+    std::uint64_t y = c1 >> 1;
+    return x * x + y * y < radius_squared;
+  }
+
+  std::size_t countScalar(std::uint32_t seed, std::size_t first, std::size_t last) {
+    std::size_t in_count = 0;
+    for (std::size_t i = first; i < last; ++i) {
+      in_count += sampleInCircle(seed, i);
+    }
+    return in_count;
+  }
+
+  // A batch of `lanes` counters may only use the vector path when the high
+  // 32 bits of the counter stay the same across it.
+  inline bool sameHighWord(std::size_t i, std::size_t lanes) {
+    return static_cast<std::uint32_t>(i) <= 0xFFFFFFFFu - (lanes - 1);
+  }
+
+#ifdef PIKERNEL_X86
+  __attribute__((target("avx2")))
+  std::size_t countAvx2(std::uint32_t seed, std::size_t first, std::size_t last) {
+    const __m256i m = _mm256_set1_epi64x(philox_m);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i limit = _mm256_set1_epi64x(static_cast<long long>(radius_squared));
+    __m256i hits = _mm256_setzero_si256();
+    std::size_t in_count = 0;
+
+    std::size_t i = first;
+    for (; i + 8 <= last; i += 8) {
+      if (!sameHighWord(i, 8)) {
+        in_count += countScalar(seed, i, i + 8);
+        continue;
+      }
+      __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(static_cast<std::uint32_t>(i))), lane);
+      __m256i c1 = _mm256_set1_epi32(static_cast<int>(static_cast<std::uint32_t>(static_cast<std::uint64_t>(i) >> 32)));
+      std::uint32_t key = seed;
+      for (int round = 0; round < philox_rounds; ++round) {
+        __m256i even = _mm256_mul_epu32(c0, m);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(c0, 32), m);
+        __m256i lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+        __m256i hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hi, c1), _mm256_set1_epi32(static_cast<int>(key)));
+        c1 = lo;
+        key += philox_w;
+      }
+      __m256i x = _mm256_srli_epi32(c0, 1);
+      __m256i y = _mm256_srli_epi32(c1, 1);
+      __m256i even = _mm256_add_epi64(_mm256_mul_epu32(x, x), _mm256_mul_epu32(y, y));
+      __m256i xo = _mm256_srli_epi64(x, 32);
+      __m256i yo = _mm256_srli_epi64(y, 32);
+      __m256i odd = _mm256_add_epi64(_mm256_mul_epu32(xo, xo), _mm256_mul_epu32(yo, yo));
+      hits = _mm256_sub_epi64(hits, _mm256_cmpgt_epi64(limit, even));
+      hits = _mm256_sub_epi64(hits, _mm256_cmpgt_epi64(limit, odd));
+    }
+
+    alignas(32) std::uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), hits);
+    in_count += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return in_count + countScalar(seed, i, last);
+  }
+
+// GCC's avx512 headers trip -Wmaybe-uninitialized on their own placeholders.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+  __attribute__((target("avx512f")))
+  std::size_t countAvx512(std::uint32_t seed, std::size_t first, std::size_t last) {
+    const __m512i m = _mm512_set1_epi64(philox_m);
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i limit = _mm512_set1_epi64(static_cast<long long>(radius_squared));
+    const __mmask16 odd_lanes = 0xAAAA;
+    std::size_t in_count = 0;
+
+    std::size_t i = first;
+    for (; i + 16 <= last; i += 16) {
+      if (!sameHighWord(i, 16)) {
+        in_count += countScalar(seed, i, i + 16);
+        continue;
+      }
+      __m512i c0 = _mm512_add_epi32(_mm512_set1_epi32(static_cast<int>(static_cast<std::uint32_t>(i))), lane);
+      __m512i c1 = _mm512_set1_epi32(static_cast<int>(static_cast<std::uint32_t>(static_cast<std::uint64_t>(i) >> 32)));
+      std::uint32_t key = seed;
+      for (int round = 0; round < philox_rounds; ++round) {
+        __m512i even = _mm512_mul_epu32(c0, m);
+        __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(c0, 32), m);
+        __m512i lo = _mm512_mask_blend_epi32(odd_lanes, even, _mm512_slli_epi64(odd, 32));
+        __m512i hi = _mm512_mask_blend_epi32(odd_lanes, _mm512_srli_epi64(even, 32), odd);
+        c0 = _mm512_xor_si512(_mm512_xor_si512(hi, c1), _mm512_set1_epi32(static_cast<int>(key)));
+        c1 = lo;
+        key += philox_w;
+      }
+      __m512i x = _mm512_srli_epi32(c0, 1);
+      __m512i y = _mm512_srli_epi32(c1, 1);
+      __m512i even = _mm512_add_epi64(_mm512_mul_epu32(x, x), _mm512_mul_epu32(y, y));
+      __m512i xo = _mm512_srli_epi64(x, 32);
+      __m512i yo = _mm512_srli_epi64(y, 32);
+      __m512i odd = _mm512_add_epi64(_mm512_mul_epu32(xo, xo), _mm512_mul_epu32(yo, yo));
+      in_count += __builtin_popcount(_mm512_cmplt_epu64_mask(even, limit));
+      in_count += __builtin_popcount(_mm512_cmplt_epu64_mask(odd, limit));
+    }
+
+    return in_count + countScalar(seed, i, last);
+  }
+#pragma GCC diagnostic pop
+#endif
+
+  typedef std::size_t (*Kernel)(std::uint32_t, std::size_t, std::size_t);
+
+  struct Dispatch {
+    Dispatch() : kernel(&countScalar), name("scalar") {
+#ifdef PIKERNEL_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")) {
+        kernel = &countAvx512;
+        name = "avx512";
+      }
+      else if (__builtin_cpu_supports("avx2")) {
+        kernel = &countAvx2;
+        name = "avx2";
+      }
+#endif
+    }
+
+    Kernel kernel;
+    const char * name;
+  };
+
+  const Dispatch & dispatch() {
+    static const Dispatch selected;
+    return selected;
+  }
+}
+
+std::size_t TP::countInCircle(std::uint32_t seed, std::size_t first, std::size_t last) {
+  return dispatch().kernel(seed, first, last);
+}
+
+const char * TP::piKernelName() {
+  return dispatch().name;
+}
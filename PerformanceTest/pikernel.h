@@ -0,0 +1,18 @@
+#ifndef _PIKERNEL_H
+#define _PIKERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TP {
+    // Counts the samples in [first, last) that land inside the unit circle.
+    // Sample i is drawn from Philox2x32-10 at counter i under key `seed`, so
+    // the count only depends on the range, never on which thread ran it or
+    // how the range was chunked.
+    std::size_t countInCircle(std::uint32_t seed, std::size_t first, std::size_t last);
+
+    // "avx512", "avx2" or "scalar": the kernel countInCircle() dispatches to.
+    const char * piKernelName();
+}
+
+#endif
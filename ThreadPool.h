@@ -27,149 +27,6009 @@
 #include <thread>
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <future>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <array>
+#include <queue>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+// Define as 0 to compile the ThreadPool::metrics() bookkeeping out.
+#ifndef PMCONCURRENCY_METRICS
+#define PMCONCURRENCY_METRICS 1
+#endif
+
+// Define as 0 to compile ThreadPoolOptions::trace_capacity out. Tracing
+// records from the metrics hooks, so it is off without them.
+#ifndef PMCONCURRENCY_TRACING
+#define PMCONCURRENCY_TRACING PMCONCURRENCY_METRICS
+#endif
+#if !PMCONCURRENCY_METRICS
+#undef PMCONCURRENCY_TRACING
+#define PMCONCURRENCY_TRACING 0
+#endif
+
+#if defined(__has_include)
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define PMCONCURRENCY_HAS_COROUTINES 1
+#include <coroutine>
+#include <optional>
+#include <variant>
+#endif
+#endif
+
+#ifndef PMCONCURRENCY_HAS_COROUTINES
+#define PMCONCURRENCY_HAS_COROUTINES 0
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 namespace PMConcurrency {
-	
-	class MainIoService {
+
+	namespace detail {
+
+#if __cplusplus >= 201703L
+		template<typename F, typename... Args>
+		using invoke_result_t = std::invoke_result_t<F, Args...>;
+#else
+		template<typename F, typename... Args>
+		using invoke_result_t = typename std::result_of<F(Args...)>::type;
+#endif
+
+		template<typename F, typename Tuple, std::size_t... I>
+		auto apply_impl(F & f, Tuple & args, std::index_sequence<I...>)
+			-> decltype(std::move(f)(std::get<I>(std::move(args))...)) {
+			return std::move(f)(std::get<I>(std::move(args))...);
+		}
+
+		template<typename F, typename... Args>
+		auto apply(F & f, std::tuple<Args...> & args)
+			-> decltype(apply_impl(f, args, std::index_sequence_for<Args...>())) {
+			return apply_impl(f, args, std::index_sequence_for<Args...>());
+		}
+
+		static const std::size_t cache_line_size = 64;
+
+		// Per-thread slab allocator for the small blocks behind tasks, future
+		// states, queue nodes, coroutine frames and asio's handler operations.
+		// Blocks come in size classes of 64 to 1024 bytes, carved from slabs
+		// owned by the allocating thread, and each one starts with a pointer to
+		// its owner's heap. A block freed on its owner goes on a plain free
+		// list; one freed on any other thread is pushed on the owner's
+		// lock-free return list, which the owner takes whole once its free list
+		// runs dry. A thread feeding workers thus keeps reusing its own blocks
+		// instead of going back to malloc while theirs pile up. The heap of a
+		// thread that has exited is freed along with its last block.
+		class BlockCache {
+		public:
+			static const std::size_t class_count = 5;
+			static const std::size_t max_block_size = std::size_t(64) << (class_count - 1);
+
+			static void * allocate(std::size_t size) {
+				if (size > max_block_size) {
+					return ::operator new(size);
+				}
+				return local().heap->allocate(class_of(size));
+			}
+
+			static void deallocate(void * p, std::size_t size) {
+				if (size > max_block_size) {
+					::operator delete(p);
+					return;
+				}
+				Header * block = static_cast<Header *>(p) - 1;
+				Heap * owner = block->owner;
+				if (owner == local().heap) {
+					owner->free_local(block, class_of(size));
+				}
+				else {
+					owner->free_remote(block, class_of(size));
+				}
+			}
+
+			// Blocks are aligned as operator new's are. A stricter alignment
+			// over-allocates and keeps the block's address below the object.
+			static void * allocate(std::size_t size, std::size_t align) {
+				if (align <= alignof(std::max_align_t)) {
+					return allocate(size);
+				}
+				void * block = allocate(size + align + sizeof(void *));
+				std::uintptr_t object = (reinterpret_cast<std::uintptr_t>(block) + sizeof(void *) + align - 1)
+					& ~static_cast<std::uintptr_t>(align - 1);
+				reinterpret_cast<void **>(object)[-1] = block;
+				return reinterpret_cast<void *>(object);
+			}
+
+			static void deallocate(void * p, std::size_t size, std::size_t align) {
+				if (align <= alignof(std::max_align_t)) {
+					deallocate(p, size);
+					return;
+				}
+				deallocate(static_cast<void **>(p)[-1], size + align + sizeof(void *));
+			}
+
+		private:
+			class Heap;
+
+			// Keeps the block behind it at the 16-byte alignment operator new gives.
+			struct Header {
+				Heap * owner;
+				Header * next; //< while free
+			};
+
+			struct Slab {
+				Slab * next;
+				Header * pad; //< alignment, as for Header
+			};
+
+			class Heap {
+			public:
+				static const std::size_t slab_size = 16 * 1024;
+
+				Heap() : _slabs(nullptr), _outstanding(0), _orphaned(0) {
+					for (std::size_t index = 0; index < class_count; ++index) {
+						_free[index] = nullptr;
+						_carve[index] = nullptr;
+						_carve_end[index] = nullptr;
+						_returned[index].store(nullptr, std::memory_order_relaxed);
+					}
+				}
+
+				~Heap() {
+					while (_slabs) {
+						Slab * slab = _slabs;
+						_slabs = slab->next;
+						::operator delete(slab);
+					}
+				}
+
+				void * allocate(std::size_t index) {
+					Header * block = _free[index];
+					if (block) {
+						_free[index] = block->next;
+					}
+					else {
+						block = refill(index);
+					}
+					++_outstanding;
+					return block + 1;
+				}
+
+				void free_local(Header * block, std::size_t index) {
+					block->next = _free[index];
+					_free[index] = block;
+					--_outstanding;
+				}
+
+				void free_remote(Header * block, std::size_t index) {
+					Header * head = _returned[index].load(std::memory_order_relaxed);
+					do {
+						if (head == retired()) {
+							if (_orphaned.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+								delete this;
+							}
+							return;
+						}
+						block->next = head;
+					} while (!_returned[index].compare_exchange_weak(head, block,
+						std::memory_order_release, std::memory_order_relaxed));
+				}
+
+				// The owning thread is exiting. Blocks still out elsewhere now count
+				// down _orphaned instead of going on a return list; whoever takes it
+				// to zero frees the heap.
+				void retire() {
+					for (std::size_t index = 0; index < class_count; ++index) {
+						Header * list = _returned[index].exchange(retired(), std::memory_order_acq_rel);
+						for (; list; list = list->next) {
+							--_outstanding;
+						}
+					}
+					long outstanding = _outstanding;
+					if (_orphaned.fetch_add(outstanding, std::memory_order_acq_rel) + outstanding == 0) {
+						delete this;
+					}
+				}
+
+			private:
+				static Header * retired() {
+					static Header marker = { nullptr, nullptr };
+					return &marker;
+				}
+
+				static std::size_t stride(std::size_t index) {
+					return sizeof(Header) + (std::size_t(64) << index);
+				}
+
+				Header * refill(std::size_t index) {
+					if (_returned[index].load(std::memory_order_relaxed)) {
+						Header * list = _returned[index].exchange(nullptr, std::memory_order_acquire);
+						for (Header * block = list; block; block = block->next) {
+							--_outstanding;
+						}
+						_free[index] = list->next;
+						return list;
+					}
+					if (_carve[index] == _carve_end[index]) {
+						Slab * slab = static_cast<Slab *>(::operator new(slab_size));
+						slab->next = _slabs;
+						_slabs = slab;
+						_carve[index] = reinterpret_cast<char *>(slab + 1);
+						_carve_end[index] = _carve[index] + (slab_size - sizeof(Slab)) / stride(index) * stride(index);
+					}
+					Header * block = reinterpret_cast<Header *>(_carve[index]);
+					_carve[index] += stride(index);
+					block->owner = this;
+					return block;
+				}
+
+				Header * _free[class_count];
+				char * _carve[class_count];     //< the unused rest of the newest slab
+				char * _carve_end[class_count];
+				Slab * _slabs;
+				long _outstanding;              //< blocks handed out, as far as the owner knows
+				char _pad[cache_line_size];
+				std::atomic<Header *> _returned[class_count]; //< freed by other threads
+				std::atomic<long> _orphaned;
+			};
+
+			struct Local {
+				Local() : heap(new Heap()) {}
+				~Local() {
+					heap->retire();
+				}
+				Heap * heap;
+			};
+
+			static std::size_t class_of(std::size_t size) {
+				std::size_t index = 0;
+				while ((std::size_t(64) << index) < size) {
+					++index;
+				}
+				return index;
+			}
+
+			static Local & local() {
+				static thread_local Local local;
+				return local;
+			}
+		};
+
+		// Lets asio allocate its handler operations from the block cache.
+		template<typename T>
+		class BlockAllocator {
+		public:
+			typedef T value_type;
+
+			BlockAllocator() noexcept {}
+
+			template<typename U>
+			BlockAllocator(const BlockAllocator<U> &) noexcept {}
+
+			T * allocate(std::size_t n) {
+				return static_cast<T *>(BlockCache::allocate(n * sizeof(T), alignof(T)));
+			}
+
+			void deallocate(T * p, std::size_t n) noexcept {
+				BlockCache::deallocate(p, n * sizeof(T), alignof(T));
+			}
+
+			template<typename U>
+			bool operator==(const BlockAllocator<U> &) const noexcept { return true; }
+
+			template<typename U>
+			bool operator!=(const BlockAllocator<U> &) const noexcept { return false; }
+		};
+
+		// The per-thread bump allocator behind scratch_allocate(). Chunks are
+		// kept once allocated, so a warm arena costs a pointer bump per
+		// allocation and a Scope per task.
+		class ScratchArena {
+			struct Chunk;
+
+		public:
+			static const std::size_t chunk_size = 64 * 1024;
+
+			// Releases what the thread allocated while it was alive.
+			class Scope {
+			public:
+				Scope() : _arena(local()), _chunk(_arena._chunk), _used(_arena._used) {}
+
+				~Scope() {
+					_arena._chunk = _chunk;
+					_arena._used = _used;
+				}
+
+				Scope(const Scope &) = delete;
+				Scope & operator=(const Scope &) = delete;
+
+			private:
+				ScratchArena & _arena;
+				Chunk * _chunk;
+				std::size_t _used;
+			};
+
+			ScratchArena() : _first(nullptr), _chunk(nullptr), _used(0) {}
+
+			~ScratchArena() {
+				while (_first) {
+					Chunk * chunk = _first;
+					_first = chunk->next;
+					::operator delete(chunk);
+				}
+			}
+
+			static ScratchArena & local() {
+				static thread_local ScratchArena arena;
+				return arena;
+			}
+
+			void * allocate(std::size_t size, std::size_t alignment) {
+				for (;;) {
+					if (Chunk * chunk = _chunk) {
+						std::uintptr_t base = reinterpret_cast<std::uintptr_t>(chunk + 1);
+						std::uintptr_t p = (base + _used + alignment - 1) & ~(std::uintptr_t(alignment) - 1);
+						if (p + size <= base + chunk->size) {
+							_used = p + size - base;
+							return reinterpret_cast<void *>(p);
+						}
+					}
+					advance(size + alignment);
+				}
+			}
+
+		private:
+			struct Chunk {
+				Chunk * next;
+				std::size_t size; //< of the data that follows
+			};
+
+			// Moves on to the next kept chunk, or puts a new one in front of it
+			// if it is too small.
+			void advance(std::size_t needed) {
+				Chunk * next = _chunk ? _chunk->next : _first;
+				if (!next || next->size < needed) {
+					std::size_t size = needed > chunk_size ? needed : chunk_size;
+					Chunk * chunk = static_cast<Chunk *>(::operator new(sizeof(Chunk) + size));
+					chunk->next = next;
+					chunk->size = size;
+					(_chunk ? _chunk->next : _first) = chunk;
+					next = chunk;
+				}
+				_chunk = next;
+				_used = 0;
+			}
+
+			Chunk * _first;
+			Chunk * _chunk;    //< in use; null before the first allocation
+			std::size_t _used; //< bytes of _chunk
+		};
+
+		// A pool whose queued tasks a thread can run while it waits on it
+		// (ThreadPool::run_pending_task()).
+		class Helper {
+		public:
+			// Runs one queued task on the calling thread; false if there was none.
+			virtual bool help() = 0;
+
+			// How long a waiter with nothing to run blocks before it looks for
+			// queued work again: tasks queued meanwhile may be the ones it
+			// needs, with every worker waiting too.
+			static std::chrono::milliseconds idle_wait() {
+				return std::chrono::milliseconds(1);
+			}
+
+		protected:
+			~Helper() {}
+		};
+
+		class FutureStateBase {
+		public:
+			FutureStateBase() : _refs(2), _flags(0), _helper(nullptr) {}
+
+			bool ready() const {
+				return (_flags.load(std::memory_order_acquire) & ready_flag) != 0;
+			}
+
+			// Runs the helper's queued tasks until the state is ready.
+			void wait() {
+				if (ready()) {
+					return;
+				}
+				std::unique_lock<std::mutex> lock(_mutex);
+				_flags.fetch_or(waiting_flag, std::memory_order_acq_rel);
+				if (!_helper) {
+					_cv.wait(lock, [this] () { return ready(); });
+					return;
+				}
+				while (!ready()) {
+					lock.unlock();
+					bool ran = _helper->help();
+					lock.lock();
+					if (!ran) {
+						_cv.wait_for(lock, Helper::idle_wait(), [this] () { return ready(); });
+					}
+				}
+			}
+
+			void set_helper(Helper * helper) {
+				_helper = helper;
+			}
+
+			template<typename Rep, typename Period>
+			bool wait_for(const std::chrono::duration<Rep, Period> & timeout) {
+				if (ready()) {
+					return true;
+				}
+				std::unique_lock<std::mutex> lock(_mutex);
+				_flags.fetch_or(waiting_flag, std::memory_order_acq_rel);
+				return _cv.wait_for(lock, timeout, [this] () { return ready(); });
+			}
+
+			void set_exception(std::exception_ptr eptr) {
+				_eptr = eptr;
+				publish();
+			}
+
+			void release() {
+				if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					destroy();
+				}
+			}
+
+		protected:
+			virtual ~FutureStateBase() {}
+			virtual void destroy() = 0;
+
+			void publish() {
+				unsigned prev = _flags.fetch_or(ready_flag, std::memory_order_acq_rel);
+				if (prev & waiting_flag) {
+					std::lock_guard<std::mutex> lock(_mutex);
+					_cv.notify_all();
+				}
+			}
+
+			void rethrow_if_error() {
+				if (_eptr) {
+					std::rethrow_exception(_eptr);
+				}
+			}
+
+		private:
+			static const unsigned ready_flag = 1;
+			static const unsigned waiting_flag = 2;
+
+			std::atomic<unsigned> _refs;
+			std::atomic<unsigned> _flags;
+			std::exception_ptr _eptr;
+			std::mutex _mutex;
+			std::condition_variable _cv;
+			Helper * _helper; //< the pool running the task, for wait()
+		};
+
+		template<typename T>
+		class FutureState : public FutureStateBase {
+		public:
+			~FutureState() {
+				if (_has_value) {
+					reinterpret_cast<T *>(&_value)->~T();
+				}
+			}
+
+			template<typename U>
+			void set_value(U && value) {
+				new (&_value) T(std::forward<U>(value));
+				_has_value = true;
+				publish();
+			}
+
+			T get() {
+				wait();
+				rethrow_if_error();
+				return std::move(*reinterpret_cast<T *>(&_value));
+			}
+
+		private:
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type _value;
+			bool _has_value = false;
+		};
+
+		template<>
+		class FutureState<void> : public FutureStateBase {
+		public:
+			void set_value() {
+				publish();
+			}
+
+			void get() {
+				wait();
+				rethrow_if_error();
+			}
+		};
+
+		// The shared state and the bound callable live in one block, so a
+		// submit() needs a single (recycled) allocation.
+		template<typename R, typename F, typename... Args>
+		class TaskState : public FutureState<R> {
+		public:
+			template<typename G, typename... A>
+			static TaskState * create(G && f, A &&... args) {
+				void * p = BlockCache::allocate(sizeof(TaskState), alignof(TaskState));
+				try {
+					return new (p) TaskState(std::forward<G>(f), std::forward<A>(args)...);
+				}
+				catch (...) {
+					BlockCache::deallocate(p, sizeof(TaskState), alignof(TaskState));
+					throw;
+				}
+			}
+
+			void run() {
+				try {
+					invoke(std::is_void<R>());
+				}
+				catch (...) {
+					this->set_exception(std::current_exception());
+				}
+			}
+
+			void abandon() {
+				this->set_exception(std::make_exception_ptr(
+					std::future_error(std::future_errc::broken_promise)));
+			}
+
+		protected:
+			void destroy() override {
+				this->~TaskState();
+				BlockCache::deallocate(this, sizeof(TaskState), alignof(TaskState));
+			}
+
+		private:
+			template<typename G, typename... A>
+			TaskState(G && f, A &&... args)
+				: _f(std::forward<G>(f)), _args(std::forward<A>(args)...) {}
+
+			void invoke(std::true_type) {
+				apply(_f, _args);
+				this->set_value();
+			}
+
+			void invoke(std::false_type) {
+				this->set_value(apply(_f, _args));
+			}
+
+			F _f;
+			std::tuple<Args...> _args;
+		};
+
+		// Owns one reference on a TaskState; breaks the promise if it is
+		// destroyed without having run.
+		template<typename State>
+		class TaskRunner {
+		public:
+			explicit TaskRunner(State * state) : _state(state) {}
+
+			TaskRunner(TaskRunner && other) noexcept : _state(other._state) {
+				other._state = nullptr;
+			}
+
+			TaskRunner(const TaskRunner &) = delete;
+			TaskRunner & operator=(const TaskRunner &) = delete;
+
+			~TaskRunner() {
+				if (_state) {
+					_state->abandon();
+					_state->release();
+				}
+			}
+
+			void operator()() {
+				State * state = _state;
+				_state = nullptr;
+				state->run();
+				state->release();
+			}
+
+		private:
+			State * _state;
+		};
+
+	}
+
+	// Move-only "void handler()" with inline storage for small callables.
+	class Task {
+	public:
+		static const std::size_t inline_size = 6 * sizeof(void *);
+
+		typedef detail::BlockAllocator<void> allocator_type;
+
+		Task() noexcept : _ops(nullptr) {}
+
+		template<typename F, typename = typename std::enable_if<
+			!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+		Task(F && f) : _ops(nullptr) {
+			typedef typename std::decay<F>::type Fn;
+			construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fits_inline<Fn>()>());
+		}
+
+		Task(Task && other) noexcept : _ops(other._ops) {
+			if (_ops) {
+				_ops->move(&_storage, &other._storage);
+				other._ops = nullptr;
+			}
+		}
+
+		Task & operator=(Task && other) noexcept {
+			if (this != &other) {
+				reset();
+				if (other._ops) {
+					other._ops->move(&_storage, &other._storage);
+					_ops = other._ops;
+					other._ops = nullptr;
+				}
+			}
+			return *this;
+		}
+
+		Task(const Task &) = delete;
+		Task & operator=(const Task &) = delete;
+
+		~Task() {
+			reset();
+		}
+
+		void operator()() {
+			_ops->invoke(&_storage);
+		}
+
+		explicit operator bool() const noexcept {
+			return _ops != nullptr;
+		}
+
+		void reset() noexcept {
+			if (_ops) {
+				_ops->destroy(&_storage);
+				_ops = nullptr;
+			}
+		}
+
+		allocator_type get_allocator() const noexcept {
+			return allocator_type();
+		}
+
+	private:
+		struct Ops {
+			void (*invoke)(void *);
+			void (*move)(void *, void *);
+			void (*destroy)(void *);
+		};
+
+		template<typename Fn>
+		static constexpr bool fits_inline() {
+			return sizeof(Fn) <= inline_size
+				&& alignof(Fn) <= alignof(std::max_align_t)
+				&& std::is_nothrow_move_constructible<Fn>::value;
+		}
+
+		template<typename Fn>
+		struct InlineOps {
+			static void invoke(void * p) {
+				(*static_cast<Fn *>(p))();
+			}
+			static void move(void * dst, void * src) {
+				new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+				static_cast<Fn *>(src)->~Fn();
+			}
+			static void destroy(void * p) {
+				static_cast<Fn *>(p)->~Fn();
+			}
+			static const Ops * get() {
+				static const Ops ops = { &invoke, &move, &destroy };
+				return &ops;
+			}
+		};
+
+		template<typename Fn>
+		struct HeapOps {
+			static Fn *& ptr(void * p) {
+				return *static_cast<Fn **>(p);
+			}
+			static void invoke(void * p) {
+				(*ptr(p))();
+			}
+			static void move(void * dst, void * src) {
+				new (dst) Fn *(ptr(src));
+			}
+			static void destroy(void * p) {
+				ptr(p)->~Fn();
+				detail::BlockCache::deallocate(ptr(p), sizeof(Fn), alignof(Fn));
+			}
+			static const Ops * get() {
+				static const Ops ops = { &invoke, &move, &destroy };
+				return &ops;
+			}
+		};
+
+		template<typename Fn, typename F>
+		void construct(F && f, std::true_type) {
+			new (&_storage) Fn(std::forward<F>(f));
+			_ops = InlineOps<Fn>::get();
+		}
+
+		template<typename Fn, typename F>
+		void construct(F && f, std::false_type) {
+			void * p = detail::BlockCache::allocate(sizeof(Fn), alignof(Fn));
+			try {
+				new (&_storage) Fn *(new (p) Fn(std::forward<F>(f)));
+			}
+			catch (...) {
+				detail::BlockCache::deallocate(p, sizeof(Fn), alignof(Fn));
+				throw;
+			}
+			_ops = HeapOps<Fn>::get();
+		}
+
+		typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type _storage;
+		const Ops * _ops;
+	};
+
+	template<typename T>
+	class Future {
+	public:
+		Future() noexcept : _state(nullptr) {}
+
+		explicit Future(detail::FutureState<T> * state) noexcept : _state(state) {}
+
+		Future(Future && other) noexcept : _state(other._state) {
+			other._state = nullptr;
+		}
+
+		Future & operator=(Future && other) noexcept {
+			if (this != &other) {
+				if (_state) {
+					_state->release();
+				}
+				_state = other._state;
+				other._state = nullptr;
+			}
+			return *this;
+		}
+
+		Future(const Future &) = delete;
+		Future & operator=(const Future &) = delete;
+
+		~Future() {
+			if (_state) {
+				_state->release();
+			}
+		}
+
+		bool valid() const noexcept {
+			return _state != nullptr;
+		}
+
+		bool ready() const {
+			return _state->ready();
+		}
+
+		// Runs the pool's other queued tasks on this thread until the task has
+		// run, so that a task waiting on another never ties up its worker.
+		void wait() const {
+			_state->wait();
+		}
+
+		// Only blocks: a helped task could overrun the timeout.
+		template<typename Rep, typename Period>
+		bool wait_for(const std::chrono::duration<Rep, Period> & timeout) const {
+			return _state->wait_for(timeout);
+		}
+
+		// Waits as wait() does; rethrows anything the task threw.
+		// The future is left invalid afterwards.
+		T get() {
+			Future self(std::move(*this));
+			return self._state->get();
+		}
+
+	private:
+		detail::FutureState<T> * _state;
+	};
+
+	// What a full bounded queue, or a pool at its in-flight limit, does with
+	// a new task. Dropped tasks are counted by ThreadPool::get_rejected_count().
+	// Under max_in_flight, DropOldest costs every admitted task a heap-allocated
+	// ticket and a lock shared by all producers, which serialises them.
+	enum class QueueFullPolicy {
+		Block,      //< wait for space, rejecting the task after ThreadPoolOptions::block_timeout
+		Reject,     //< drop the new task
+		CallerRuns, //< run it on the posting thread
+		DropOldest  //< drop the oldest task not yet started to make room
+	};
+
+	namespace detail {
+
+		inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#elif defined(__aarch64__)
+			asm volatile("yield");
+#else
+			std::this_thread::yield();
+#endif
+		}
+
+		struct WorkerIdentity {
+			const void * pool;
+			std::size_t index;
+		};
+
+		inline WorkerIdentity & current_worker() {
+			static thread_local WorkerIdentity identity = { nullptr, 0 };
+			return identity;
+		}
+
+		inline Task * new_task(Task && task) {
+			return new (BlockCache::allocate(sizeof(Task))) Task(std::move(task));
+		}
+
+		inline void delete_task(Task * task) {
+			task->~Task();
+			BlockCache::deallocate(task, sizeof(Task));
+		}
+
+		// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for
+		// Weak Memory Models") with the paper's fences folded into seq_cst
+		// accesses. The owning worker pushes and pops at the bottom, any other
+		// thread may steal from the top.
+		class WorkStealingDeque {
+		public:
+			explicit WorkStealingDeque(std::size_t capacity = 256)
+				: _top(0), _bottom(0), _array(new Array(capacity)) {
+			}
+
+			~WorkStealingDeque() {
+				Task * task;
+				while ((task = pop()) != nullptr) {
+					delete_task(task);
+				}
+				delete _array.load(std::memory_order_relaxed);
+			}
+
+			WorkStealingDeque(const WorkStealingDeque &) = delete;
+			WorkStealingDeque & operator=(const WorkStealingDeque &) = delete;
+
+			// Owner only.
+			void push(Task * task) {
+				std::int64_t b = _bottom.load(std::memory_order_relaxed);
+				std::int64_t t = _top.load(std::memory_order_acquire);
+				Array * a = _array.load(std::memory_order_relaxed);
+				if (b - t > static_cast<std::int64_t>(a->capacity) - 1) {
+					Array * bigger = a->grow(b, t);
+					_retired.emplace_back(a);
+					_array.store(bigger, std::memory_order_release);
+					a = bigger;
+				}
+				a->put(b, task);
+				_bottom.store(b + 1, std::memory_order_release);
+			}
+
+			// Owner only; returns the most recently pushed task.
+			Task * pop() {
+				std::int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+				Array * a = _array.load(std::memory_order_relaxed);
+				_bottom.store(b, std::memory_order_seq_cst);
+				std::int64_t t = _top.load(std::memory_order_seq_cst);
+				if (t > b) {
+					_bottom.store(b + 1, std::memory_order_release);
+					return nullptr;
+				}
+				Task * task = a->get(b);
+				if (t == b) {
+					if (!_top.compare_exchange_strong(t, t + 1,
+						std::memory_order_seq_cst, std::memory_order_relaxed)) {
+						task = nullptr;
+					}
+					_bottom.store(b + 1, std::memory_order_release);
+				}
+				return task;
+			}
+
+			// Any thread; returns the oldest task, or nullptr when empty or
+			// when another thief won the race.
+			Task * steal() {
+				std::int64_t t = _top.load(std::memory_order_seq_cst);
+				std::int64_t b = _bottom.load(std::memory_order_seq_cst);
+				if (t >= b) {
+					return nullptr;
+				}
+				Array * a = _array.load(std::memory_order_acquire);
+				Task * task = a->get(t);
+				if (!_top.compare_exchange_strong(t, t + 1,
+					std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					return nullptr;
+				}
+				return task;
+			}
+
+			bool empty() const {
+				std::int64_t t = _top.load(std::memory_order_seq_cst);
+				std::int64_t b = _bottom.load(std::memory_order_seq_cst);
+				return t >= b;
+			}
+
+			// Approximate when other threads are pushing or stealing.
+			std::size_t size() const {
+				std::int64_t t = _top.load(std::memory_order_relaxed);
+				std::int64_t b = _bottom.load(std::memory_order_relaxed);
+				return b > t ? static_cast<std::size_t>(b - t) : 0;
+			}
+
+		private:
+			struct Array {
+				explicit Array(std::size_t cap)
+					: capacity(cap), mask(cap - 1), slots(new std::atomic<Task *>[cap]) {
+				}
+
+				Task * get(std::int64_t i) const {
+					return slots[static_cast<std::size_t>(i) & mask].load(std::memory_order_relaxed);
+				}
+
+				void put(std::int64_t i, Task * task) {
+					slots[static_cast<std::size_t>(i) & mask].store(task, std::memory_order_relaxed);
+				}
+
+				Array * grow(std::int64_t b, std::int64_t t) const {
+					Array * a = new Array(capacity * 2);
+					for (std::int64_t i = t; i < b; ++i) {
+						a->put(i, get(i));
+					}
+					return a;
+				}
+
+				std::size_t capacity;
+				std::size_t mask;
+				std::unique_ptr<std::atomic<Task *>[]> slots;
+			};
+
+			std::atomic<std::int64_t> _top;
+			char _pad0[cache_line_size - sizeof(std::atomic<std::int64_t>)];
+			std::atomic<std::int64_t> _bottom;
+			char _pad1[cache_line_size - sizeof(std::atomic<std::int64_t>)];
+			std::atomic<Array *> _array;
+			std::vector<std::unique_ptr<Array>> _retired; //< thieves may still read old arrays
+		};
+
+		enum class ParkResult {
+			Woken,
+			Stopped,  //< stopping and nothing left to run
+			TimedOut
+		};
+
+		// Blocks idle workers on a condition variable. notify() bumps an epoch
+		// under the mutex, so a wake-up racing with park() is never lost.
+		class IdleParker {
+		public:
+			IdleParker() : _idle(0), _wake_epoch(0), _stopping(false) {}
+
+			// Polls has_work() up to `spin` times; true once it reports work.
+			template<typename HasWork>
+			bool spin(unsigned spin, HasWork has_work) const {
+				for (unsigned i = 0; i < spin; ++i) {
+					if (has_work()) {
+						return true;
+					}
+					cpu_relax();
+				}
+				return false;
+			}
+
+			// Waits for notify() or stop(), or for `timeout` when non-zero.
+			template<typename HasWork>
+			ParkResult park(std::chrono::milliseconds timeout, HasWork has_work) {
+				std::unique_lock<std::mutex> lock(_mutex);
+				unsigned long epoch = _wake_epoch;
+				_idle.fetch_add(1, std::memory_order_seq_cst);
+				if (has_work()) {
+					_idle.fetch_sub(1, std::memory_order_relaxed);
+					return ParkResult::Woken;
+				}
+				if (_stopping) {
+					_idle.fetch_sub(1, std::memory_order_relaxed);
+					return ParkResult::Stopped;
+				}
+				auto woken = [this, epoch] () { return _wake_epoch != epoch || _stopping; };
+				bool signalled = true;
+				if (timeout.count() > 0) {
+					signalled = _cv.wait_for(lock, timeout, woken) || has_work();
+				}
+				else {
+					_cv.wait(lock, woken);
+				}
+				_idle.fetch_sub(1, std::memory_order_relaxed);
+				return signalled ? ParkResult::Woken : ParkResult::TimedOut;
+			}
+
+			// Wakes up to `count` parked workers.
+			void notify(std::size_t count = 1) {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				std::size_t idle = _idle.load(std::memory_order_relaxed);
+				if (idle == 0) {
+					return;
+				}
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					++_wake_epoch;
+				}
+				if (count >= idle) {
+					_cv.notify_all();
+					return;
+				}
+				for (std::size_t i = 0; i < count; ++i) {
+					_cv.notify_one();
+				}
+			}
+
+			void restart() {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = false;
+			}
+
+			void stop() {
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_stopping = true;
+				}
+				_cv.notify_all();
+			}
+
+		private:
+			std::mutex _mutex;
+			std::condition_variable _cv;
+			std::atomic<std::size_t> _idle;
+			unsigned long _wake_epoch;
+			bool _stopping;
+		};
+
+		// Counts the tasks a pool has been handed and the ones that have run or
+		// been discarded, for ThreadPool::wait_idle(). As with the metrics, each
+		// worker counts in its own padded slot and other threads share one.
+		class TaskTracker {
+		public:
+			struct Slot {
+				Slot() : posted(0), finished(0) {}
+				char pad[cache_line_size];
+				std::atomic<std::uint64_t> posted;
+				std::atomic<std::uint64_t> finished;
+			};
+
+			struct Finish {
+				TaskTracker * tracker;
+				~Finish() {
+					tracker->finished();
+				}
+			};
+
+			TaskTracker(const void * pool, std::size_t workers) : _pool(pool), _discarding(false) {
+				for (std::size_t i = 0; i <= workers; ++i) {
+					_slots.emplace_back(new Slot());
+				}
+			}
+
+			// Before the tasks are visible to any worker.
+			void posted(std::size_t count = 1) {
+				current().posted.fetch_add(count, std::memory_order_relaxed);
+			}
+
+			void finished(std::size_t count = 1) {
+				current().finished.fetch_add(count, std::memory_order_release);
+			}
+
+			// True if, at some point during the call, every task posted had
+			// finished: finished counts are read first and never run ahead.
+			bool idle() const {
+				std::uint64_t finished = 0;
+				std::uint64_t posted = 0;
+				for (auto & slot : _slots) {
+					finished += slot->finished.load(std::memory_order_acquire);
+				}
+				for (auto & slot : _slots) {
+					posted += slot->posted.load(std::memory_order_acquire);
+				}
+				return finished == posted;
+			}
+
+			// While set, tasks that reach a worker are destroyed unrun.
+			bool discarding() const {
+				return _discarding.load(std::memory_order_relaxed);
+			}
+
+			void set_discarding(bool discarding) {
+				_discarding.store(discarding, std::memory_order_relaxed);
+			}
+
+		private:
+			Slot & current() {
+				const WorkerIdentity & identity = current_worker();
+				if (identity.pool == _pool && identity.index + 1 < _slots.size()) {
+					return *_slots[identity.index];
+				}
+				return *_slots.back();
+			}
+
+			const void * _pool;
+			std::vector<std::unique_ptr<Slot>> _slots;
+			std::atomic<bool> _discarding;
+		};
+
+		// A queue backend that ThreadPool runs its workers on, in place of asio.
+		class Scheduler {
+		public:
+			explicit Scheduler(TaskTracker & tracker) : _tracker(tracker) {}
+			virtual ~Scheduler() {}
+
+			virtual void post(Task && task) = 0;
+			virtual void post_bulk(std::vector<Task> & tasks) = 0;
+			virtual void post_on_node(Task && task, std::size_t node) = 0; //< node is a hint
+
+			// Queues task only if that needs no waiting, dropping or running it
+			// here; on false, task is left as it was.
+			virtual bool try_post(Task & task) {
+				post(std::move(task));
+				return true;
+			}
+
+			// Runs tasks on worker `index` until stop() is called and no work is
+			// left. An idle worker first polls the queues `spin` times before it
+			// blocks, and once it has been blocked for idle_timeout (when
+			// non-zero) it returns if retire() agrees.
+			virtual void run(std::size_t index, unsigned spin, std::chrono::milliseconds idle_timeout,
+				const std::function<bool ()> & retire) = 0;
+
+			// Runs one queued task on the calling thread, worker or not; false
+			// if none was found.
+			virtual bool run_one() = 0;
+
+			// Tasks queued but not yet started, approximately.
+			virtual std::size_t pending() const = 0;
+
+			// Tasks dropped by a full bounded queue.
+			virtual std::size_t rejected() const {
+				return 0;
+			}
+
+			virtual void restart() = 0;
+			virtual void stop() = 0;
+
+			// Like stop(), but run() returns after the task in hand and leaves
+			// the rest queued.
+			virtual void abort() = 0;
+
+			// Destroys every queued task unrun and returns how many there were.
+			// Only while no worker is in run().
+			virtual std::size_t discard() = 0;
+
+		protected:
+			TaskTracker & _tracker; //< told about every task that ran or was dropped
+		};
+
+		// Per-worker deques with LIFO local pushes and randomized stealing.
+		// Tasks posted from outside the pool go through per-node injection
+		// queues; workers look at their own node's queue and victims before
+		// touching another node's.
+		class WorkStealingScheduler : public Scheduler {
+		public:
+			WorkStealingScheduler(TaskTracker & tracker, const std::vector<std::size_t> & worker_nodes,
+				std::size_t nodes)
+				: Scheduler(tracker), _next_node(0), _aborted(false) {
+				for (std::size_t n = 0; n < nodes; ++n) {
+					_nodes.emplace_back(new NodeQueue());
+				}
+				for (std::size_t i = 0; i < worker_nodes.size(); ++i) {
+					_workers.emplace_back(new Worker(i, worker_nodes[i]));
+				}
+				for (auto & worker : _workers) {
+					for (auto & victim : _workers) {
+						if (victim != worker) {
+							(victim->node == worker->node ? worker->near : worker->far).push_back(victim.get());
+						}
+					}
+				}
+			}
+
+			~WorkStealingScheduler() override {
+				for (auto & node : _nodes) {
+					for (Task * task : node->tasks) {
+						delete_task(task);
+					}
+				}
+			}
+
+			void post(Task && task) override {
+				WorkerSlot & slot = current();
+				if (slot.owner == this) {
+					push_local(std::move(task), slot.index);
+				}
+				else {
+					std::size_t node = _nodes.size() == 1 ? 0
+						: _next_node.fetch_add(1, std::memory_order_relaxed) % _nodes.size();
+					inject(std::move(task), node);
+				}
+			}
+
+			// Queues all of `tasks` under one lock (or none, on a worker) and
+			// wakes at most one parked worker per task.
+			void post_bulk(std::vector<Task> & tasks) override {
+				WorkerSlot & slot = current();
+				if (slot.owner == this) {
+					WorkStealingDeque & deque = _workers[slot.index]->deque;
+					for (Task & task : tasks) {
+						deque.push(new_task(std::move(task)));
+					}
+				}
+				else {
+					std::size_t node = _nodes.size() == 1 ? 0
+						: _next_node.fetch_add(1, std::memory_order_relaxed) % _nodes.size();
+					NodeQueue & queue = *_nodes[node];
+					std::vector<Task *> staged;
+					staged.reserve(tasks.size());
+					for (Task & task : tasks) {
+						staged.push_back(new_task(std::move(task)));
+					}
+					std::lock_guard<std::mutex> lock(queue.mutex);
+					queue.tasks.insert(queue.tasks.end(), staged.begin(), staged.end());
+					queue.size.fetch_add(staged.size(), std::memory_order_relaxed);
+				}
+				_parker.notify(tasks.size());
+			}
+
+			void post_on_node(Task && task, std::size_t node) override {
+				node %= _nodes.size();
+				WorkerSlot & slot = current();
+				if (slot.owner == this && _workers[slot.index]->node == node) {
+					push_local(std::move(task), slot.index);
+				}
+				else {
+					inject(std::move(task), node);
+				}
+			}
+
+			void run(std::size_t index, unsigned spin, std::chrono::milliseconds idle_timeout,
+				const std::function<bool ()> & retire) override {
+				CurrentWorker scope(this, index);
+				Worker & self = *_workers[index];
+				for (;;) {
+					if (_aborted.load(std::memory_order_relaxed)) {
+						break;
+					}
+					if (Task * task = find(self)) {
+						execute(task);
+						continue;
+					}
+					auto has_work = [this] () { return this->has_work(); };
+					if (_parker.spin(spin, has_work)) {
+						continue;
+					}
+					ParkResult result = _parker.park(idle_timeout, has_work);
+					if (result == ParkResult::Stopped || (result == ParkResult::TimedOut && retire())) {
+						break;
+					}
+				}
+			}
+
+			// Outside the workers, injected tasks come first, then anything that
+			// can be stolen.
+			bool run_one() override {
+				WorkerSlot & slot = current();
+				Task * task = nullptr;
+				if (slot.owner == this) {
+					task = find(*_workers[slot.index]);
+				}
+				else {
+					for (std::size_t n = 0; n < _nodes.size() && !task; ++n) {
+						task = pop_injected(*_nodes[n]);
+					}
+					for (std::size_t i = 0; i < _workers.size() && !task; ++i) {
+						task = _workers[i]->deque.steal();
+					}
+				}
+				if (!task) {
+					return false;
+				}
+				execute(task);
+				return true;
+			}
+
+			std::size_t pending() const override {
+				std::size_t count = 0;
+				for (auto & node : _nodes) {
+					count += node->size.load(std::memory_order_relaxed);
+				}
+				for (auto & worker : _workers) {
+					count += worker->deque.size();
+				}
+				return count;
+			}
+
+			void restart() override {
+				_aborted.store(false, std::memory_order_relaxed);
+				_parker.restart();
+			}
+
+			void stop() override {
+				_parker.stop();
+			}
+
+			void abort() override {
+				_aborted.store(true, std::memory_order_relaxed);
+				_parker.stop();
+			}
+
+			// Destroying a task may post another, which goes to a node queue.
+			std::size_t discard() override {
+				std::size_t count = 0;
+				for (std::size_t found = 1; found != 0; count += found) {
+					found = 0;
+					for (auto & worker : _workers) {
+						while (Task * task = worker->deque.pop()) {
+							delete_task(task);
+							++found;
+						}
+					}
+					for (auto & node : _nodes) {
+						while (Task * task = pop_injected(*node)) {
+							delete_task(task);
+							++found;
+						}
+					}
+				}
+				_tracker.finished(count);
+				return count;
+			}
+
+		private:
+			struct Worker {
+				Worker(std::size_t index, std::size_t n) : node(n), rng(0x9E3779B97F4A7C15ull * (index + 1)) {}
+				WorkStealingDeque deque;
+				std::size_t node;
+				std::uint64_t rng;
+				std::vector<Worker *> near; //< victims on the same node
+				std::vector<Worker *> far;
+			};
+
+			struct NodeQueue {
+				NodeQueue() : size(0) {}
+				std::mutex mutex;
+				std::deque<Task *> tasks;
+				std::atomic<std::size_t> size;
+			};
+
+			struct WorkerSlot {
+				const WorkStealingScheduler * owner;
+				std::size_t index;
+			};
+
+			struct CurrentWorker {
+				CurrentWorker(const WorkStealingScheduler * owner, std::size_t index) : saved(current()) {
+					current().owner = owner;
+					current().index = index;
+				}
+				~CurrentWorker() {
+					current() = saved;
+				}
+				WorkerSlot saved;
+			};
+
+			struct TaskDeleter {
+				explicit TaskDeleter(Task * t) : task(t) {}
+				~TaskDeleter() {
+					delete_task(task);
+				}
+				Task * task;
+			};
+
+			static WorkerSlot & current() {
+				static thread_local WorkerSlot slot = { nullptr, 0 };
+				return slot;
+			}
+
+			Task * find(Worker & self) {
+				Task * task = self.deque.pop();
+				if (!task) {
+					task = pop_injected(*_nodes[self.node]);
+				}
+				if (!task) {
+					task = steal(self, self.near);
+				}
+				if (!task) {
+					task = pop_injected_elsewhere(self);
+				}
+				if (!task) {
+					task = steal(self, self.far);
+				}
+				return task;
+			}
+
+			void execute(Task * task) {
+				TaskTracker::Finish finish = { &_tracker };
+				TaskDeleter guard(task);
+				ScratchArena::Scope scratch;
+				(*task)();
+			}
+
+			void push_local(Task && task, std::size_t index) {
+				_workers[index]->deque.push(new_task(std::move(task)));
+				_parker.notify();
+			}
+
+			void inject(Task && task, std::size_t node) {
+				Task * t = new_task(std::move(task));
+				{
+					NodeQueue & queue = *_nodes[node];
+					std::lock_guard<std::mutex> lock(queue.mutex);
+					queue.tasks.push_back(t);
+					queue.size.fetch_add(1, std::memory_order_relaxed);
+				}
+				_parker.notify();
+			}
+
+			static Task * pop_injected(NodeQueue & queue) {
+				if (queue.size.load(std::memory_order_relaxed) == 0) {
+					return nullptr;
+				}
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if (queue.tasks.empty()) {
+					return nullptr;
+				}
+				Task * task = queue.tasks.front();
+				queue.tasks.pop_front();
+				queue.size.fetch_sub(1, std::memory_order_relaxed);
+				return task;
+			}
+
+			Task * pop_injected_elsewhere(Worker & self) {
+				for (std::size_t n = 1; n < _nodes.size(); ++n) {
+					if (Task * task = pop_injected(*_nodes[(self.node + n) % _nodes.size()])) {
+						return task;
+					}
+				}
+				return nullptr;
+			}
+
+			static Task * steal(Worker & self, std::vector<Worker *> & victims) {
+				std::size_t count = victims.size();
+				if (count == 0) {
+					return nullptr;
+				}
+				self.rng ^= self.rng << 13;
+				self.rng ^= self.rng >> 7;
+				self.rng ^= self.rng << 17;
+				std::size_t start = static_cast<std::size_t>(self.rng % count);
+				for (std::size_t i = 0; i < count; ++i) {
+					if (Task * task = victims[(start + i) % count]->deque.steal()) {
+						return task;
+					}
+				}
+				return nullptr;
+			}
+
+			bool has_work() const {
+				for (auto & node : _nodes) {
+					if (node->size.load(std::memory_order_seq_cst) != 0) {
+						return true;
+					}
+				}
+				for (auto & worker : _workers) {
+					if (!worker->deque.empty()) {
+						return true;
+					}
+				}
+				return false;
+			}
+
+			std::vector<std::unique_ptr<Worker>> _workers;
+			std::vector<std::unique_ptr<NodeQueue>> _nodes;
+			std::atomic<std::size_t> _next_node;
+			std::atomic<bool> _aborted;
+			IdleParker _parker;
+		};
+
+		// Bounded MPMC queue after Dmitry Vyukov's design: every cell carries a
+		// sequence number that says whether it is free for the producer at a
+		// position or holds the value for the consumer at it, so a push or pop
+		// is one CAS on the shared position. Capacity is a power of two.
+		template<typename T>
+		class BoundedMpmcQueue {
+		public:
+			explicit BoundedMpmcQueue(std::size_t capacity)
+				: _mask(round_up(capacity) - 1),
+				_storage(new unsigned char[(_mask + 1) * sizeof(Cell) + cache_line_size]),
+				_enqueue_pos(0), _dequeue_pos(0) {
+				std::uintptr_t base = reinterpret_cast<std::uintptr_t>(_storage.get());
+				_cells = reinterpret_cast<Cell *>(
+					(base + cache_line_size - 1) & ~(static_cast<std::uintptr_t>(cache_line_size) - 1));
+				for (std::size_t i = 0; i <= _mask; ++i) {
+					new (&_cells[i]) Cell();
+					_cells[i].sequence.store(i, std::memory_order_relaxed);
+				}
+			}
+
+			~BoundedMpmcQueue() {
+				for (std::size_t i = 0; i <= _mask; ++i) {
+					_cells[i].~Cell();
+				}
+			}
+
+			BoundedMpmcQueue(const BoundedMpmcQueue &) = delete;
+			BoundedMpmcQueue & operator=(const BoundedMpmcQueue &) = delete;
+
+			// Moves from `value` only on success; false when full.
+			bool try_push(T & value) {
+				std::size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+				Cell * cell;
+				for (;;) {
+					cell = &_cells[pos & _mask];
+					std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+					std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+					if (diff == 0) {
+						if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+							break;
+						}
+					}
+					else if (diff < 0) {
+						return false;
+					}
+					else {
+						pos = _enqueue_pos.load(std::memory_order_relaxed);
+					}
+				}
+				cell->value = std::move(value);
+				cell->sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+
+			// False when empty.
+			bool try_pop(T & value) {
+				std::size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+				Cell * cell;
+				for (;;) {
+					cell = &_cells[pos & _mask];
+					std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+					std::intptr_t diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+					if (diff == 0) {
+						if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+							break;
+						}
+					}
+					else if (diff < 0) {
+						return false;
+					}
+					else {
+						pos = _dequeue_pos.load(std::memory_order_relaxed);
+					}
+				}
+				value = std::move(cell->value);
+				cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+				return true;
+			}
+
+			// Approximate while other threads push or pop.
+			std::size_t size() const {
+				std::size_t tail = _enqueue_pos.load(std::memory_order_relaxed);
+				std::size_t head = _dequeue_pos.load(std::memory_order_relaxed);
+				return tail > head ? tail - head : 0;
+			}
+
+			std::size_t capacity() const {
+				return _mask + 1;
+			}
+
+		private:
+			struct Cell {
+				std::atomic<std::size_t> sequence;
+				T value;
+			};
+
+			static std::size_t round_up(std::size_t capacity) {
+				std::size_t size = 2;
+				while (size < capacity) {
+					size <<= 1;
+				}
+				return size;
+			}
+
+			const std::size_t _mask;
+			std::unique_ptr<unsigned char[]> _storage;
+			Cell * _cells;
+			char _pad0[cache_line_size];
+			std::atomic<std::size_t> _enqueue_pos;
+			char _pad1[cache_line_size - sizeof(std::atomic<std::size_t>)];
+			std::atomic<std::size_t> _dequeue_pos;
+			char _pad2[cache_line_size - sizeof(std::atomic<std::size_t>)];
+		};
+
+		// All workers share one bounded ring. What a full ring does to post()
+		// is set by `when_full`; a worker that would block runs the task itself
+		// instead, since blocking every worker on a full queue would deadlock.
+		class RingScheduler : public Scheduler {
+		public:
+			RingScheduler(TaskTracker & tracker, std::size_t capacity, QueueFullPolicy when_full,
+				std::chrono::milliseconds timeout)
+				: Scheduler(tracker), _queue(capacity), _when_full(when_full), _timeout(timeout), _aborted(false),
+				_blocked(0), _rejected(0) {}
+
+			void post(Task && task) override {
+				if (_queue.try_push(task)) {
+					_parker.notify();
+					return;
+				}
+				overflow(task);
+			}
+
+			bool try_post(Task & task) override {
+				if (!_queue.try_push(task)) {
+					return false;
+				}
+				_parker.notify();
+				return true;
+			}
+
+			void post_bulk(std::vector<Task> & tasks) override {
+				std::size_t pushed = 0;
+				for (Task & task : tasks) {
+					if (_queue.try_push(task)) {
+						++pushed;
+						continue;
+					}
+					_parker.notify(pushed);
+					pushed = 0;
+					overflow(task);
+				}
+				_parker.notify(pushed);
+			}
+
+			void post_on_node(Task && task, std::size_t) override {
+				post(std::move(task));
+			}
+
+			void run(std::size_t, unsigned spin, std::chrono::milliseconds idle_timeout,
+				const std::function<bool ()> & retire) override {
+				Worker scope(this);
+				auto has_work = [this] () { return _queue.size() != 0; };
+				for (;;) {
+					if (_aborted.load(std::memory_order_relaxed)) {
+						break;
+					}
+					if (run_one()) {
+						continue;
+					}
+					if (_parker.spin(spin, has_work)) {
+						continue;
+					}
+					ParkResult result = _parker.park(idle_timeout, has_work);
+					if (result == ParkResult::Stopped || (result == ParkResult::TimedOut && retire())) {
+						break;
+					}
+				}
+			}
+
+			bool run_one() override {
+				Task task;
+				if (!_queue.try_pop(task)) {
+					return false;
+				}
+				if (_blocked.load(std::memory_order_relaxed) != 0) {
+					std::lock_guard<std::mutex> lock(_space_mutex);
+					_space_cv.notify_all();
+				}
+				TaskTracker::Finish finish = { &_tracker };
+				ScratchArena::Scope scratch;
+				task();
+				return true;
+			}
+
+			std::size_t pending() const override {
+				return _queue.size();
+			}
+
+			std::size_t rejected() const override {
+				return _rejected.load(std::memory_order_relaxed);
+			}
+
+			void restart() override {
+				_aborted.store(false, std::memory_order_relaxed);
+				_parker.restart();
+			}
+
+			void stop() override {
+				_parker.stop();
+			}
+
+			void abort() override {
+				_aborted.store(true, std::memory_order_relaxed);
+				_parker.stop();
+			}
+
+			std::size_t discard() override {
+				std::size_t count = 0;
+				Task task;
+				while (_queue.try_pop(task)) {
+					task.reset();
+					++count;
+				}
+				_tracker.finished(count);
+				return count;
+			}
+
+		private:
+			struct Worker {
+				explicit Worker(const RingScheduler * owner) : saved(current()) {
+					current() = owner;
+				}
+				~Worker() {
+					current() = saved;
+				}
+				const RingScheduler * saved;
+			};
+
+			static const RingScheduler *& current() {
+				static thread_local const RingScheduler * owner = nullptr;
+				return owner;
+			}
+
+			void overflow(Task & task) {
+				QueueFullPolicy policy = _when_full;
+				if (policy == QueueFullPolicy::Block && current() == this) {
+					policy = QueueFullPolicy::CallerRuns;
+				}
+				switch (policy) {
+				case QueueFullPolicy::Block: {
+					// The timed wait covers a pop that raced with _blocked going up.
+					std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + _timeout;
+					std::unique_lock<std::mutex> lock(_space_mutex);
+					_blocked.fetch_add(1, std::memory_order_relaxed);
+					bool pushed;
+					while (!(pushed = _queue.try_push(task))) {
+						if (_timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+							break;
+						}
+						_space_cv.wait_for(lock, std::chrono::milliseconds(1));
+					}
+					_blocked.fetch_sub(1, std::memory_order_relaxed);
+					lock.unlock();
+					if (pushed) {
+						_parker.notify();
+					}
+					else {
+						reject(task);
+					}
+					break;
+				}
+				case QueueFullPolicy::Reject:
+					reject(task);
+					break;
+				case QueueFullPolicy::CallerRuns: {
+					Task run(std::move(task));
+					TaskTracker::Finish finish = { &_tracker };
+					ScratchArena::Scope scratch;
+					run();
+					break;
+				}
+				case QueueFullPolicy::DropOldest: {
+					Task oldest;
+					while (!_queue.try_push(task)) {
+						if (_queue.try_pop(oldest)) {
+							reject(oldest);
+						}
+					}
+					_parker.notify();
+					break;
+				}
+				}
+			}
+
+			void reject(Task & task) {
+				_rejected.fetch_add(1, std::memory_order_relaxed);
+				task.reset();
+				_tracker.finished();
+			}
+
+			BoundedMpmcQueue<Task> _queue;
+			const QueueFullPolicy _when_full;
+			const std::chrono::milliseconds _timeout; //< for Block; 0 waits forever
+			std::atomic<bool> _aborted;
+			IdleParker _parker;
+			std::mutex _space_mutex;
+			std::condition_variable _space_cv;
+			std::atomic<std::size_t> _blocked;   //< producers waiting for space
+			std::atomic<std::size_t> _rejected;
+		};
+
+	}
+
+	enum class SchedulerMode {
+		Asio,         //< all workers run one shared asio::io_service
+		WorkStealing, //< per-worker deques with randomized stealing
+		BoundedRing   //< one lock-free bounded ring shared by all workers
+	};
+
+	// CPUs this process may run on, grouped by NUMA node. On Linux the nodes
+	// come from /sys/devices/system/node, filtered by sched_getaffinity();
+	// anywhere else, or when /sys is unreadable, there is a single node.
+	struct CpuTopology {
+		std::vector<std::vector<int>> nodes;
+		double cpu_quota = 0; //< CPUs' worth of time the cgroup allows; 0 when unlimited
+
+		std::size_t cpu_count() const {
+			std::size_t count = 0;
+			for (auto & node : nodes) {
+				count += node.size();
+			}
+			return count;
+		}
+
+		// The CPUs the process may run on, capped by its CPU quota rounded up:
+		// how many threads it can keep busy without being throttled.
+		std::size_t usable_cpus() const {
+			std::size_t cpus = std::max<std::size_t>(cpu_count(), 1);
+			if (cpu_quota > 0) {
+				cpus = std::min(cpus, std::max<std::size_t>(static_cast<std::size_t>(std::ceil(cpu_quota)), 1));
+			}
+			return cpus;
+		}
+
+		static CpuTopology detect() {
+			CpuTopology topology;
+#ifdef __linux__
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+			if (DIR * dir = opendir("/sys/devices/system/node")) {
+				std::vector<std::pair<int, std::vector<int>>> found;
+				while (dirent * entry = readdir(dir)) {
+					int id;
+					char tail;
+					if (std::sscanf(entry->d_name, "node%d%c", &id, &tail) != 1) {
+						continue;
+					}
+					std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+					std::string list;
+					if (!std::getline(file, list)) {
+						continue;
+					}
+					std::vector<int> cpus;
+					for (int cpu : parse_cpu_list(list)) {
+						if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+							cpus.push_back(cpu);
+						}
+					}
+					if (!cpus.empty()) {
+						found.emplace_back(id, std::move(cpus));
+					}
+				}
+				closedir(dir);
+				std::sort(found.begin(), found.end());
+				for (auto & node : found) {
+					topology.nodes.push_back(std::move(node.second));
+				}
+			}
+			if (topology.nodes.empty() && masked) {
+				std::vector<int> cpus;
+				for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+					if (CPU_ISSET(cpu, &allowed)) {
+						cpus.push_back(cpu);
+					}
+				}
+				if (!cpus.empty()) {
+					topology.nodes.push_back(std::move(cpus));
+				}
+			}
+#endif
+			if (topology.nodes.empty()) {
+				std::vector<int> cpus;
+				unsigned count = std::max(1u, std::thread::hardware_concurrency());
+				for (unsigned cpu = 0; cpu < count; ++cpu) {
+					cpus.push_back(static_cast<int>(cpu));
+				}
+				topology.nodes.push_back(std::move(cpus));
+			}
+			topology.cpu_quota = detect_cpu_quota();
+			return topology;
+		}
+
+		// The tightest CPU bandwidth limit (quota over period) on the cgroups
+		// from the process's own up to the root, under cgroup v2 or v1; 0 if
+		// there is none.
+		static double detect_cpu_quota() {
+			double quota = 0;
+#ifdef __linux__
+			std::ifstream self("/proc/self/cgroup");
+			std::string line;
+			while (std::getline(self, line)) {
+				// hierarchy-id:controllers:path, with no controllers under v2
+				std::size_t first = line.find(':');
+				std::size_t second = first == std::string::npos ? first : line.find(':', first + 1);
+				if (second == std::string::npos) {
+					continue;
+				}
+				std::string controllers = line.substr(first + 1, second - first - 1);
+				std::string path = line.substr(second + 1);
+				if (controllers.empty()) {
+					quota = tighter(quota, cgroup_quota("/sys/fs/cgroup", path, true));
+				}
+				else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+					quota = tighter(quota, cgroup_quota("/sys/fs/cgroup/" + controllers, path, false));
+					quota = tighter(quota, cgroup_quota("/sys/fs/cgroup/cpu", path, false));
+				}
+			}
+#endif
+			return quota;
+		}
+
+		// Parses the kernel's cpulist format, e.g. "0-3,8-11".
+		static std::vector<int> parse_cpu_list(const std::string & list) {
+			std::vector<int> cpus;
+			std::istringstream in(list);
+			std::string range;
+			while (std::getline(in, range, ',')) {
+				int first, last;
+				int fields = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+				if (fields < 1 || first < 0) {
+					continue;
+				}
+				if (fields == 1) {
+					last = first;
+				}
+				for (int cpu = first; cpu <= last; ++cpu) {
+					cpus.push_back(cpu);
+				}
+			}
+			return cpus;
+		}
+
+	private:
+		static double tighter(double a, double b) {
+			return a == 0 || (b != 0 && b < a) ? b : a;
+		}
+
+		// A container often sees only its own cgroup, mounted at root, while
+		// /proc/self/cgroup still names the host's path; walking up covers both.
+		static double cgroup_quota(const std::string & root, std::string path, bool v2) {
+			double quota = 0;
+			for (;;) {
+				quota = tighter(quota, read_cpu_limit(root + path, v2));
+				std::size_t slash = path.find_last_of('/');
+				if (path.empty() || slash == std::string::npos) {
+					return quota;
+				}
+				path.erase(slash);
+			}
+		}
+
+		static double read_cpu_limit(const std::string & dir, bool v2) {
+			long long quota = 0;
+			long long period = 0;
+			if (v2) {
+				std::ifstream file(dir + "/cpu.max");
+				std::string max;
+				if (!(file >> max >> period) || max == "max") {
+					return 0;
+				}
+				std::istringstream(max) >> quota;
+			}
+			else {
+				std::ifstream quota_file(dir + "/cpu.cfs_quota_us");
+				std::ifstream period_file(dir + "/cpu.cfs_period_us");
+				if (!(quota_file >> quota) || !(period_file >> period)) {
+					return 0;
+				}
+			}
+			return quota > 0 && period > 0 ? static_cast<double>(quota) / static_cast<double>(period) : 0;
+		}
+	};
+
+	// Workers for a pool sized by default: PMCONCURRENCY_THREADS when it is
+	// a number from 1 to 1024, otherwise CpuTopology::usable_cpus() - 1,
+	// which leaves a CPU to the main thread but still gives a single-CPU
+	// process one worker. Detected once per process.
+	inline std::size_t default_thread_count() {
+		static const std::size_t count = [] () -> std::size_t {
+			const char * env = std::getenv("PMCONCURRENCY_THREADS");
+			if (env && *env >= '0' && *env <= '9') {
+				char * end = nullptr;
+				unsigned long threads = std::strtoul(env, &end, 10);
+				if (*end == '\0' && threads > 0 && threads <= 1024) {
+					return threads;
+				}
+			}
+			std::size_t cpus = CpuTopology::detect().usable_cpus();
+			return cpus > 1 ? cpus - 1 : 1;
+		}();
+		return count;
+	}
+
+	enum class Priority {
+		High,
+		Normal,
+		Background
+	};
+
+	enum class DispatchPolicy {
+		Strict,   //< always the highest non-empty lane
+		Weighted  //< lanes share the workers by ThreadPoolOptions::lane_weights
+	};
+
+	enum class DeadlinePolicy {
+		Drop,     //< discard tasks whose deadline passed before they started
+		Promote   //< move them to Priority::High instead
+	};
+
+	namespace detail {
+
+		// One FIFO per Priority. The pool posts a token to its queue for every
+		// task pushed here, and each token runs whichever task pop() picks, so
+		// a new high priority task only waits for the next free worker.
+		class PriorityLanes {
+		public:
+			static const std::size_t lane_count = 3;
+
+			PriorityLanes(DispatchPolicy dispatch, const std::array<unsigned, lane_count> & weights,
+				DeadlinePolicy deadline_policy)
+				: _dispatch(dispatch), _weights(weights), _deadline_policy(deadline_policy),
+				_next_id(0), _dropped(0) {
+				for (std::size_t lane = 0; lane < lane_count; ++lane) {
+					_live[lane] = 0;
+					_credit[lane] = 0;
+				}
+			}
+
+			// Returns an id for withdraw().
+			std::uint64_t push(Task && task, Priority priority) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				return append(static_cast<std::size_t>(priority), std::move(task));
+			}
+
+			void push(Task && task, Priority priority, std::chrono::steady_clock::time_point deadline) {
+				std::size_t lane = static_cast<std::size_t>(priority);
+				std::lock_guard<std::mutex> lock(_mutex);
+				std::uint64_t id = append(lane, std::move(task));
+				_deadlines.push(Deadline{ deadline, lane, id });
+			}
+
+			// Returns an empty Task when every queued task has been dropped.
+			Task pop() {
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!_deadlines.empty()) {
+					expire(std::chrono::steady_clock::now());
+				}
+				std::size_t lane = pick();
+				if (lane == lane_count) {
+					return Task();
+				}
+				std::deque<Entry> & queue = _lanes[lane];
+				while (!queue.front().task) {
+					queue.pop_front();
+				}
+				Task task(std::move(queue.front().task));
+				queue.pop_front();
+				--_live[lane];
+				return task;
+			}
+
+			// Takes back a task pushed without a deadline; empty if it has
+			// already been popped.
+			Task withdraw(Priority priority, std::uint64_t id) {
+				std::size_t lane = static_cast<std::size_t>(priority);
+				std::lock_guard<std::mutex> lock(_mutex);
+				Entry * entry = find(lane, id);
+				if (!entry) {
+					return Task();
+				}
+				--_live[lane];
+				return std::move(entry->task);
+			}
+
+			std::size_t dropped() const {
+				return _dropped.load(std::memory_order_relaxed);
+			}
+
+			// Destroys every queued task, outside the lock, and returns how many
+			// there were.
+			std::size_t clear() {
+				std::deque<Entry> cleared[lane_count];
+				std::size_t count = 0;
+				std::lock_guard<std::mutex> lock(_mutex);
+				for (std::size_t lane = 0; lane < lane_count; ++lane) {
+					cleared[lane].swap(_lanes[lane]);
+					count += _live[lane];
+					_live[lane] = 0;
+				}
+				_deadlines = decltype(_deadlines)();
+				return count;
+			}
+
+		private:
+			struct Entry {
+				Task task; //< empty once promoted or dropped
+				std::uint64_t id;
+			};
+
+			struct Deadline {
+				std::chrono::steady_clock::time_point when;
+				std::size_t lane;
+				std::uint64_t id;
+
+				bool operator>(const Deadline & other) const {
+					return when > other.when;
+				}
+			};
+
+			std::uint64_t append(std::size_t lane, Task && task) {
+				std::uint64_t id = _next_id++;
+				_lanes[lane].push_back(Entry{ std::move(task), id });
+				++_live[lane];
+				return id;
+			}
+
+			// Ids grow monotonically within a lane, so entries can be found by
+			// binary search; tasks that already ran are simply not found.
+			Entry * find(std::size_t lane, std::uint64_t id) {
+				std::deque<Entry> & queue = _lanes[lane];
+				auto it = std::lower_bound(queue.begin(), queue.end(), id,
+					[] (const Entry & entry, std::uint64_t value) { return entry.id < value; });
+				if (it == queue.end() || it->id != id || !it->task) {
+					return nullptr;
+				}
+				return &*it;
+			}
+
+			void expire(std::chrono::steady_clock::time_point now) {
+				while (!_deadlines.empty() && _deadlines.top().when <= now) {
+					Deadline deadline = _deadlines.top();
+					_deadlines.pop();
+					Entry * entry = find(deadline.lane, deadline.id);
+					if (!entry) {
+						continue;
+					}
+					if (_deadline_policy == DeadlinePolicy::Promote) {
+						if (deadline.lane != 0) {
+							Task task(std::move(entry->task));
+							--_live[deadline.lane];
+							append(0, std::move(task));
+						}
+					}
+					else {
+						entry->task.reset();
+						--_live[deadline.lane];
+						_dropped.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+			}
+
+			// Smooth weighted round-robin over the non-empty lanes when weighted.
+			std::size_t pick() {
+				std::size_t best = lane_count;
+				if (_dispatch == DispatchPolicy::Strict) {
+					for (std::size_t lane = 0; lane < lane_count; ++lane) {
+						if (_live[lane]) {
+							return lane;
+						}
+					}
+					return best;
+				}
+				long total = 0;
+				for (std::size_t lane = 0; lane < lane_count; ++lane) {
+					if (!_live[lane]) {
+						continue;
+					}
+					_credit[lane] += _weights[lane];
+					total += _weights[lane];
+					if (best == lane_count || _credit[lane] > _credit[best]) {
+						best = lane;
+					}
+				}
+				if (best != lane_count) {
+					_credit[best] -= total;
+				}
+				return best;
+			}
+
+			const DispatchPolicy _dispatch;
+			const std::array<unsigned, lane_count> _weights;
+			const DeadlinePolicy _deadline_policy;
+			std::mutex _mutex;
+			std::deque<Entry> _lanes[lane_count];
+			std::size_t _live[lane_count];
+			long _credit[lane_count];
+			std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> _deadlines;
+			std::uint64_t _next_id;
+			std::atomic<std::size_t> _dropped;
+		};
+
+	}
+
+	enum class Affinity {
+		None,     //< let the OS place workers
+		Compact,  //< worker i on the i-th allowed CPU, filling node 0 first
+		Scatter,  //< workers dealt round-robin across NUMA nodes
+		Explicit  //< worker i on ThreadPoolOptions::cpus[i % cpus.size()]
+	};
+
+	struct ThreadPoolOptions {
+		size_t threads = default_thread_count(); //< the upper bound when elastic
+		SchedulerMode mode = SchedulerMode::Asio;
+		Affinity affinity = Affinity::None;
+		std::vector<int> cpus;  //< for Affinity::Explicit
+		bool numa = false;      //< one sub-pool with its own queue per NUMA node
+		CpuTopology topology;   //< CpuTopology::detect() when left empty
+		bool priority_lanes = false; //< route plain enqueue()/submit() through the Normal lane too
+		DispatchPolicy dispatch = DispatchPolicy::Strict;
+		std::array<unsigned, 3> lane_weights = {{ 8, 4, 1 }}; //< High, Normal, Background
+		DeadlinePolicy deadline_policy = DeadlinePolicy::Drop;
+		bool elastic = false;        //< run between min_threads and threads workers
+		size_t min_threads = 1;
+		std::chrono::microseconds grow_after{ 1000 };  //< add a worker once queued work waited this long
+		std::chrono::milliseconds retire_after{ 10000 }; //< an elastic worker idle this long exits
+		unsigned spin_before_park = 0; //< queue polls an idle worker makes before it blocks
+		size_t queue_capacity = 4096;  //< SchedulerMode::BoundedRing, rounded up to a power of two
+		size_t max_in_flight = 0;      //< tasks queued or running before when_full applies; 0 for no limit
+		QueueFullPolicy when_full = QueueFullPolicy::Block; //< at max_in_flight, or with a full BoundedRing
+		std::chrono::milliseconds block_timeout{ 0 };       //< QueueFullPolicy::Block; 0 waits forever
+		size_t trace_capacity = 0;     //< task runs kept per thread for ThreadPool::flush_trace(); 0 turns tracing off
+		// Called on the worker with each exception that escapes an enqueue()d
+		// task; must not throw. Without one, see ThreadPool::checkError().
+		std::function<void (std::exception_ptr)> on_error;
+	};
+
+	namespace detail {
+
+		struct WorkerPlacement {
+			std::size_t node;      //< sub-pool index
+			std::vector<int> cpus; //< affinity mask, empty when unpinned
+		};
+
+		inline bool pin_current_thread(const std::vector<int> & cpus) {
+#ifdef __linux__
+			if (cpus.empty()) {
+				return false;
+			}
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (int cpu : cpus) {
+				if (cpu >= 0 && cpu < CPU_SETSIZE) {
+					CPU_SET(cpu, &set);
+				}
+			}
+			return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+			(void)cpus;
+			return false;
+#endif
+		}
+
+		// Sub-pools are only formed for nodes that end up with workers, and are
+		// numbered densely in node order.
+		inline std::vector<WorkerPlacement> plan_placement(const ThreadPoolOptions & options,
+			const CpuTopology & topology, std::size_t & node_count) {
+			const std::vector<std::vector<int>> & nodes = topology.nodes;
+			bool numa = options.numa && nodes.size() > 1;
+			std::vector<int> flat;
+			std::map<int, std::size_t> node_of;
+			for (std::size_t n = 0; n < nodes.size(); ++n) {
+				for (int cpu : nodes[n]) {
+					flat.push_back(cpu);
+					node_of[cpu] = n;
+				}
+			}
+
+			std::vector<WorkerPlacement> placements(std::max<std::size_t>(options.threads, 1));
+			for (std::size_t i = 0; i < placements.size(); ++i) {
+				WorkerPlacement & placement = placements[i];
+				std::size_t node = numa ? i % nodes.size() : 0;
+				switch (options.affinity) {
+				case Affinity::Compact: {
+					int cpu = flat[i % flat.size()];
+					node = node_of[cpu];
+					placement.cpus.push_back(cpu);
+					break;
+				}
+				case Affinity::Scatter: {
+					node = i % nodes.size();
+					placement.cpus.push_back(nodes[node][(i / nodes.size()) % nodes[node].size()]);
+					break;
+				}
+				case Affinity::Explicit:
+					if (!options.cpus.empty()) {
+						int cpu = options.cpus[i % options.cpus.size()];
+						auto found = node_of.find(cpu);
+						node = found != node_of.end() ? found->second : 0;
+						placement.cpus.push_back(cpu);
+					}
+					else if (numa) {
+						placement.cpus = nodes[node];
+					}
+					break;
+				case Affinity::None:
+					if (numa) {
+						placement.cpus = nodes[node];
+					}
+					break;
+				}
+				placement.node = numa ? node : 0;
+			}
+
+			std::map<std::size_t, std::size_t> dense;
+			for (auto & placement : placements) {
+				dense.emplace(placement.node, 0);
+			}
+			node_count = 0;
+			for (auto & entry : dense) {
+				entry.second = node_count++;
+			}
+			for (auto & placement : placements) {
+				placement.node = dense[placement.node];
+			}
+			if (node_count == 0) {
+				node_count = 1;
+			}
+			return placements;
+		}
+
+	}
+
+	// Log-linear latency histogram in the style of HdrHistogram: values below 8ns
+	// are exact, above that each power of two is split into 8 buckets, so a
+	// reported value is at most 12.5% off.
+	class LatencyHistogram {
+	public:
+		static const std::size_t sub_buckets = 8;
+		static const std::size_t bucket_count = 62 * sub_buckets;
+
+		LatencyHistogram() : _counts(bucket_count, 0) {}
+
+		static std::size_t bucket_of(std::uint64_t ns) {
+			if (ns < sub_buckets) {
+				return static_cast<std::size_t>(ns);
+			}
+			std::size_t exponent = 63 - static_cast<std::size_t>(__builtin_clzll(ns));
+			return (exponent - 2) * sub_buckets + static_cast<std::size_t>((ns >> (exponent - 3)) & (sub_buckets - 1));
+		}
+
+		// Smallest value that falls into bucket `index`.
+		static std::uint64_t bucket_lower(std::size_t index) {
+			if (index < sub_buckets) {
+				return index;
+			}
+			std::size_t exponent = index / sub_buckets + 2;
+			return static_cast<std::uint64_t>(sub_buckets + index % sub_buckets) << (exponent - 3);
+		}
+
+		void add(std::size_t bucket, std::uint64_t count) {
+			_counts[bucket] += count;
+		}
+
+		void record(std::chrono::nanoseconds value) {
+			add(bucket_of(static_cast<std::uint64_t>(std::max<std::int64_t>(value.count(), 0))), 1);
+		}
+
+		void merge(const LatencyHistogram & other) {
+			for (std::size_t i = 0; i < bucket_count; ++i) {
+				_counts[i] += other._counts[i];
+			}
+		}
+
+		std::uint64_t count() const {
+			std::uint64_t total = 0;
+			for (std::uint64_t n : _counts) {
+				total += n;
+			}
+			return total;
+		}
+
+		// Lower bound of the bucket holding the q-th quantile (0 <= q <= 1).
+		std::chrono::nanoseconds percentile(double q) const {
+			std::uint64_t total = count();
+			if (total == 0) {
+				return std::chrono::nanoseconds(0);
+			}
+			std::uint64_t rank = static_cast<std::uint64_t>(std::min(std::max(q, 0.0), 1.0) * (total - 1)) + 1;
+			std::uint64_t seen = 0;
+			std::size_t i = 0;
+			for (; i < bucket_count; ++i) {
+				seen += _counts[i];
+				if (seen >= rank) {
+					break;
+				}
+			}
+			return std::chrono::nanoseconds(static_cast<std::int64_t>(bucket_lower(i)));
+		}
+
+		const std::vector<std::uint64_t> & counts() const {
+			return _counts;
+		}
+
+	private:
+		std::vector<std::uint64_t> _counts;
+	};
+
+	struct WorkerMetrics {
+		std::uint64_t completed = 0;
+		std::chrono::nanoseconds busy{ 0 }; //< time spent running tasks
+		std::chrono::nanoseconds idle{ 0 }; //< time alive but not running tasks
+		LatencyHistogram queue_wait;        //< post to start
+		LatencyHistogram run_time;
+	};
+
+	// A point-in-time copy of ThreadPool::metrics(). Counters are read one by
+	// one with relaxed loads, so they are only approximately consistent.
+	struct ThreadPoolMetrics {
+		std::uint64_t submitted = 0;
+		std::uint64_t completed = 0;
+		std::uint64_t queue_depth = 0;       //< submitted but not yet started
+		std::vector<WorkerMetrics> workers;  //< indexed like ThreadPool::get_worker_index()
+		LatencyHistogram queue_wait;         //< all tasks, including those run off the workers
+		LatencyHistogram run_time;
+	};
+
+	// One task run, from ThreadPool::flush_trace().
+	struct TraceEvent {
+		const char * label;  //< the TraceLabel it was queued under, or null
+		std::size_t thread;  //< worker index, or get_thread_size() and up for other threads that ran tasks
+		std::chrono::steady_clock::time_point enqueued;
+		std::chrono::steady_clock::time_point started;
+		std::chrono::steady_clock::time_point finished;
+	};
+
+	// Names, in traces, the tasks this thread queues while the label is in
+	// scope, and the tasks those queue in turn. The string is not copied and
+	// must outlive the export.
+	class TraceLabel {
+	public:
+		explicit TraceLabel(const char * label) : _saved(slot()) {
+			slot() = label;
+		}
+
+		~TraceLabel() {
+			slot() = _saved;
+		}
+
+		TraceLabel(const TraceLabel &) = delete;
+		TraceLabel & operator=(const TraceLabel &) = delete;
+
+		static const char * current() {
+			return slot();
+		}
+
+	private:
+		static const char *& slot() {
+			static thread_local const char * label = nullptr;
+			return label;
+		}
+
+		const char * _saved;
+	};
+
+	namespace detail {
+
+		inline std::uint64_t now_ns() {
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+
+#if PMCONCURRENCY_METRICS
+		// One slot per worker plus a shared one for every other thread. Slots are
+		// written with relaxed atomics and only read by snapshot().
+		class MetricsRecorder {
+		public:
+			struct Slot {
+				Slot() : submitted(0), started(0), completed(0), busy_ns(0), alive_ns(0), running_since(0) {
+					for (std::size_t i = 0; i < LatencyHistogram::bucket_count; ++i) {
+						wait[i].store(0, std::memory_order_relaxed);
+						run[i].store(0, std::memory_order_relaxed);
+					}
+				}
+
+				char pad[cache_line_size];
+				std::atomic<std::uint64_t> submitted;
+				std::atomic<std::uint64_t> started;
+				std::atomic<std::uint64_t> completed;
+				std::atomic<std::uint64_t> busy_ns;
+				std::atomic<std::uint64_t> alive_ns;
+				std::atomic<std::uint64_t> running_since; //< 0 while the worker is not running
+				std::atomic<std::uint64_t> wait[LatencyHistogram::bucket_count];
+				std::atomic<std::uint64_t> run[LatencyHistogram::bucket_count];
+			};
+
+			MetricsRecorder(const void * pool, std::size_t workers) : _pool(pool) {
+				for (std::size_t i = 0; i <= workers; ++i) {
+					_slots.emplace_back(new Slot());
+				}
+			}
+
+			Slot & current() {
+				const WorkerIdentity & identity = current_worker();
+				if (identity.pool == _pool && identity.index + 1 < _slots.size()) {
+					return *_slots[identity.index];
+				}
+				return *_slots.back();
+			}
+
+			Slot & worker(std::size_t index) {
+				return *_slots[index];
+			}
+
+			void worker_started(std::size_t index) {
+				_slots[index]->running_since.store(now_ns(), std::memory_order_relaxed);
+			}
+
+			void worker_stopped(std::size_t index) {
+				Slot & slot = *_slots[index];
+				std::uint64_t since = slot.running_since.exchange(0, std::memory_order_relaxed);
+				if (since) {
+					slot.alive_ns.fetch_add(now_ns() - since, std::memory_order_relaxed);
+				}
+			}
+
+			void snapshot(ThreadPoolMetrics & metrics) const {
+				std::uint64_t now = now_ns();
+				std::uint64_t started = 0;
+				metrics.workers.resize(_slots.size() - 1);
+				for (std::size_t i = 0; i < _slots.size(); ++i) {
+					const Slot & slot = *_slots[i];
+					WorkerMetrics worker;
+					worker.completed = slot.completed.load(std::memory_order_relaxed);
+					std::uint64_t busy = slot.busy_ns.load(std::memory_order_relaxed);
+					std::uint64_t alive = slot.alive_ns.load(std::memory_order_relaxed);
+					std::uint64_t since = slot.running_since.load(std::memory_order_relaxed);
+					if (since && now > since) {
+						alive += now - since;
+					}
+					worker.busy = std::chrono::nanoseconds(busy);
+					worker.idle = std::chrono::nanoseconds(alive > busy ? alive - busy : 0);
+					for (std::size_t b = 0; b < LatencyHistogram::bucket_count; ++b) {
+						worker.queue_wait.add(b, slot.wait[b].load(std::memory_order_relaxed));
+						worker.run_time.add(b, slot.run[b].load(std::memory_order_relaxed));
+					}
+					metrics.submitted += slot.submitted.load(std::memory_order_relaxed);
+					metrics.completed += worker.completed;
+					started += slot.started.load(std::memory_order_relaxed);
+					metrics.queue_wait.merge(worker.queue_wait);
+					metrics.run_time.merge(worker.run_time);
+					if (i + 1 < _slots.size()) {
+						metrics.workers[i] = std::move(worker);
+					}
+				}
+				metrics.queue_depth = metrics.submitted > started ? metrics.submitted - started : 0;
+			}
+
+		private:
+			const void * _pool;
+			std::vector<std::unique_ptr<Slot>> _slots;
+		};
+
+#if PMCONCURRENCY_TRACING
+		// A ring of the latest task runs per thread: workers own the first
+		// rings, other threads get one with their first task. Only its thread
+		// writes a ring, so recording is a few relaxed stores. Each entry has a
+		// sequence number, odd while it is written, so that flush() can drop
+		// entries overwritten while it copied them.
+		class TraceRecorder {
+		public:
+			TraceRecorder(const void * pool, std::size_t workers, std::size_t capacity)
+				: _pool(pool), _id(next_id()), _capacity(capacity) {
+				for (std::size_t i = 0; i < workers; ++i) {
+					_workers.emplace_back(new Ring(capacity));
+				}
+			}
+
+			void record(const char * label, std::uint64_t enqueued, std::uint64_t started, std::uint64_t finished) {
+				Ring & ring = current();
+				std::uint64_t n = ring.written.load(std::memory_order_relaxed);
+				Entry & entry = ring.entries[n % _capacity];
+				entry.seq.store(2 * n + 1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_release);
+				entry.label.store(label, std::memory_order_relaxed);
+				entry.enqueued.store(enqueued, std::memory_order_relaxed);
+				entry.started.store(started, std::memory_order_relaxed);
+				entry.finished.store(finished, std::memory_order_relaxed);
+				entry.seq.store(2 * n + 2, std::memory_order_release);
+				ring.written.store(n + 1, std::memory_order_release);
+			}
+
+			// Appends the runs recorded since the last flush() that are still
+			// in the rings.
+			void flush(std::vector<TraceEvent> & events) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				for (std::size_t i = 0; i < _workers.size() + _others.size(); ++i) {
+					Ring & ring = i < _workers.size() ? *_workers[i] : *_others[i - _workers.size()];
+					std::uint64_t written = ring.written.load(std::memory_order_acquire);
+					std::uint64_t n = ring.flushed;
+					if (written - n > _capacity) {
+						n = written - _capacity;
+					}
+					for (; n < written; ++n) {
+						Entry & entry = ring.entries[n % _capacity];
+						std::uint64_t seq = entry.seq.load(std::memory_order_acquire);
+						TraceEvent event = { entry.label.load(std::memory_order_relaxed), i,
+							time_point(entry.enqueued.load(std::memory_order_relaxed)),
+							time_point(entry.started.load(std::memory_order_relaxed)),
+							time_point(entry.finished.load(std::memory_order_relaxed)) };
+						std::atomic_thread_fence(std::memory_order_acquire);
+						if (seq == 2 * n + 2 && entry.seq.load(std::memory_order_relaxed) == seq) {
+							events.push_back(event);
+						}
+					}
+					ring.flushed = written;
+				}
+			}
+
+		private:
+			struct Entry {
+				std::atomic<std::uint64_t> seq; //< 2n + 2 once the n-th run of the ring is in
+				std::atomic<const char *> label;
+				std::atomic<std::uint64_t> enqueued;
+				std::atomic<std::uint64_t> started;
+				std::atomic<std::uint64_t> finished;
+			};
+
+			struct Ring {
+				explicit Ring(std::size_t capacity) : entries(new Entry[capacity]()), written(0), flushed(0) {}
+
+				char pad[cache_line_size];
+				std::unique_ptr<Entry[]> entries;
+				std::atomic<std::uint64_t> written;
+				std::uint64_t flushed;  //< under _mutex
+				std::thread::id owner;  //< in _others
+			};
+
+			// Remembers the ring of the last recorder this thread ran a task for.
+			struct Cached {
+				std::uint64_t recorder;
+				Ring * ring;
+			};
+
+			static std::uint64_t next_id() {
+				static std::atomic<std::uint64_t> id(0);
+				return ++id;
+			}
+
+			static std::chrono::steady_clock::time_point time_point(std::uint64_t ns) {
+				return std::chrono::steady_clock::time_point(
+					std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(ns)));
+			}
+
+			Ring & current() {
+				const WorkerIdentity & identity = current_worker();
+				if (identity.pool == _pool && identity.index < _workers.size()) {
+					return *_workers[identity.index];
+				}
+				static thread_local Cached cached = { 0, nullptr };
+				if (cached.recorder != _id) {
+					cached.ring = &thread_ring();
+					cached.recorder = _id;
+				}
+				return *cached.ring;
+			}
+
+			Ring & thread_ring() {
+				std::lock_guard<std::mutex> lock(_mutex);
+				std::thread::id self = std::this_thread::get_id();
+				for (auto & ring : _others) {
+					if (ring->owner == self) {
+						return *ring;
+					}
+				}
+				_others.emplace_back(new Ring(_capacity));
+				_others.back()->owner = self;
+				return *_others.back();
+			}
+
+			const void * _pool;
+			const std::uint64_t _id;
+			const std::size_t _capacity;
+			std::vector<std::unique_ptr<Ring>> _workers;
+			std::mutex _mutex;  //< flush() and _others
+			std::vector<std::unique_ptr<Ring>> _others; //< threads other than the workers, in order of first run
+		};
+#endif
+
+		// What the pool queues in place of a task while metrics are compiled in.
+		struct MeteredTask {
+			MetricsRecorder * metrics;
+			Task task;
+			std::uint64_t enqueued;
+#if PMCONCURRENCY_TRACING
+			TraceRecorder * trace; //< null when tracing is off
+			const char * label;
+#endif
+
+			void operator()() {
+				struct Finish {
+					MeteredTask & metered;
+					MetricsRecorder::Slot & slot;
+					std::uint64_t start;
+					~Finish() {
+						std::uint64_t end = now_ns();
+						std::uint64_t run = end - start;
+						slot.run[LatencyHistogram::bucket_of(run)].fetch_add(1, std::memory_order_relaxed);
+						slot.busy_ns.fetch_add(run, std::memory_order_relaxed);
+						slot.completed.fetch_add(1, std::memory_order_relaxed);
+#if PMCONCURRENCY_TRACING
+						if (metered.trace) {
+							metered.trace->record(metered.label, metered.enqueued, start, end);
+						}
+#endif
+					}
+				};
+				MetricsRecorder::Slot & slot = metrics->current();
+				std::uint64_t start = now_ns();
+				slot.started.fetch_add(1, std::memory_order_relaxed);
+				slot.wait[LatencyHistogram::bucket_of(start > enqueued ? start - enqueued : 0)]
+					.fetch_add(1, std::memory_order_relaxed);
+				Finish finish = { *this, slot, start };
+#if PMCONCURRENCY_TRACING
+				TraceLabel scope(label);
+#endif
+				task();
+			}
+		};
+#endif
+
+	}
+
+	namespace detail {
+
+		class TaskBatch {
+		public:
+			explicit TaskBatch(std::vector<Task> && tasks) : _tasks(std::move(tasks)), _next(0) {}
+
+			std::size_t size() const {
+				return _tasks.size();
+			}
+
+			bool done() const {
+				return _next.load(std::memory_order_relaxed) >= _tasks.size();
+			}
+
+			// Runs unclaimed tasks until there are none left.
+			void drain() {
+				for (;;) {
+					std::size_t index = _next.fetch_add(1, std::memory_order_relaxed);
+					if (index >= _tasks.size()) {
+						return;
+					}
+					Task task(std::move(_tasks[index]));
+					ScratchArena::Scope scratch;
+					task();
+				}
+			}
+
+		private:
+			std::vector<Task> _tasks;
+			std::atomic<std::size_t> _next;
+		};
+
+		// What the pool posts to asio in place of a handler: it is counted out
+		// for wait_idle(), and for pending() on elastic pools, and skipped while
+		// the pool discards its queues.
+		template<typename Handler>
+		struct TrackedHandler {
+			typedef BlockAllocator<void> allocator_type;
+
+			TaskTracker * tracker;
+			std::atomic<std::size_t> * queued; //< elastic pools only
+			Handler handler;
+
+			allocator_type get_allocator() const noexcept {
+				return allocator_type();
+			}
+
+			void operator()() {
+				if (queued) {
+					queued->fetch_sub(1, std::memory_order_relaxed);
+				}
+				TaskTracker::Finish finish = { tracker };
+				ScratchArena::Scope scratch;
+				if (!tracker->discarding()) {
+					handler();
+				}
+			}
+		};
+
+		// Caps the tasks a pool has queued or running (ThreadPoolOptions::max_in_flight).
+		// An admitted task holds its slot until it has run or been destroyed.
+		class Admission {
+		public:
+			enum Result { Admitted, Refused, RunHere };
+
+			Admission(std::size_t limit, QueueFullPolicy when_full, std::chrono::milliseconds timeout)
+				: _limit(limit), _when_full(when_full), _timeout(timeout), _in_flight(0), _blocked(0), _rejected(0) {}
+
+			bool enabled() const {
+				return _limit != 0;
+			}
+
+			bool try_acquire() {
+				std::size_t in_flight = _in_flight.load(std::memory_order_relaxed);
+				while (in_flight < _limit) {
+					if (_in_flight.compare_exchange_weak(in_flight, in_flight + 1, std::memory_order_relaxed)) {
+						return true;
+					}
+				}
+				return false;
+			}
+
+			// Takes a slot, applying when_full if there is none. On a worker Block
+			// becomes CallerRuns, as the worker may hold the slots it waits for.
+			Result acquire(bool on_worker) {
+				if (try_acquire()) {
+					return Admitted;
+				}
+				QueueFullPolicy policy = _when_full;
+				if (policy == QueueFullPolicy::Block && on_worker) {
+					policy = QueueFullPolicy::CallerRuns;
+				}
+				switch (policy) {
+				case QueueFullPolicy::Block:
+					if (wait()) {
+						return Admitted;
+					}
+					break;
+				case QueueFullPolicy::Reject:
+					break;
+				case QueueFullPolicy::CallerRuns:
+					return RunHere;
+				case QueueFullPolicy::DropOldest:
+					if (dropOldest()) {
+						return Admitted;
+					}
+					break;
+				}
+				reject();
+				return Refused;
+			}
+
+			// Wraps an admitted task so that it gives its slot back. Under
+			// DropOldest this allocates a ticket and takes _tickets_mutex.
+			Task wrap(Task && task) {
+				if (_when_full != QueueFullPolicy::DropOldest) {
+					return Task(Slot(this, std::move(task)));
+				}
+				std::shared_ptr<Ticket> ticket = std::make_shared<Ticket>(std::move(task));
+				std::lock_guard<std::mutex> lock(_tickets_mutex);
+				while (!_tickets.empty() && _tickets.front()->started.load(std::memory_order_relaxed)) {
+					_tickets.pop_front();
+				}
+				// Tasks that started behind one still queued pile up; sweep them.
+				if (_tickets.size() >= 2 * _limit) {
+					_tickets.erase(std::remove_if(_tickets.begin(), _tickets.end(),
+						[] (const std::shared_ptr<Ticket> & t) { return t->started.load(std::memory_order_relaxed); }),
+						_tickets.end());
+				}
+				_tickets.push_back(ticket);
+				return Task(TicketSlot(this, std::move(ticket)));
+			}
+
+			void reject() {
+				_rejected.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			std::size_t in_flight() const {
+				return _in_flight.load(std::memory_order_relaxed);
+			}
+
+			std::size_t rejected() const {
+				return _rejected.load(std::memory_order_relaxed);
+			}
+
+		private:
+			struct Slot {
+				Slot(Admission * a, Task && t) : admission(a), task(std::move(t)) {}
+				Slot(Slot && other) noexcept : admission(other.admission), task(std::move(other.task)) {
+					other.admission = nullptr;
+				}
+				~Slot() {
+					if (admission) {
+						task.reset();
+						admission->release();
+					}
+				}
+				void operator()() {
+					task();
+				}
+				Admission * admission;
+				Task task;
+			};
+
+			// Under DropOldest the task is shared with _tickets; whoever flips
+			// `started` first, the worker or a dropOldest(), owns it.
+			struct Ticket {
+				explicit Ticket(Task && t) : task(std::move(t)), started(false) {}
+				bool claim() {
+					return !started.exchange(true, std::memory_order_acq_rel);
+				}
+				Task task;
+				std::atomic<bool> started;
+			};
+
+			struct TicketSlot {
+				TicketSlot(Admission * a, std::shared_ptr<Ticket> && t)
+					: admission(a), ticket(std::move(t)), claimed(false) {}
+				TicketSlot(TicketSlot &&) = default;
+				~TicketSlot() {
+					if (ticket && (claimed || ticket->claim())) {
+						ticket->task.reset();
+						admission->release();
+					}
+				}
+				void operator()() {
+					if (ticket->claim()) {
+						claimed = true;
+						ticket->task();
+					}
+				}
+				Admission * admission;
+				std::shared_ptr<Ticket> ticket;
+				bool claimed;
+			};
+
+			void release() {
+				_in_flight.fetch_sub(1, std::memory_order_relaxed);
+				if (_blocked.load(std::memory_order_relaxed) != 0) {
+					std::lock_guard<std::mutex> lock(_mutex);
+					_cv.notify_one();
+				}
+			}
+
+			// The timed wait covers a release that raced with _blocked going up.
+			bool wait() {
+				std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + _timeout;
+				std::unique_lock<std::mutex> lock(_mutex);
+				_blocked.fetch_add(1, std::memory_order_relaxed);
+				bool admitted;
+				while (!(admitted = try_acquire())) {
+					if (_timeout.count() != 0 && std::chrono::steady_clock::now() >= deadline) {
+						break;
+					}
+					_cv.wait_for(lock, std::chrono::milliseconds(1));
+				}
+				_blocked.fetch_sub(1, std::memory_order_relaxed);
+				return admitted;
+			}
+
+			// The dropped task's slot passes to the new one.
+			bool dropOldest() {
+				std::shared_ptr<Ticket> victim;
+				{
+					std::lock_guard<std::mutex> lock(_tickets_mutex);
+					while (!_tickets.empty() && !victim) {
+						if (_tickets.front()->claim()) {
+							victim = _tickets.front();
+						}
+						_tickets.pop_front();
+					}
+				}
+				if (!victim) {
+					return false;
+				}
+				victim->task.reset();
+				reject();
+				return true;
+			}
+
+			const std::size_t _limit;
+			const QueueFullPolicy _when_full;
+			const std::chrono::milliseconds _timeout; //< for Block; 0 waits forever
+			std::atomic<std::size_t> _in_flight;
+			std::atomic<std::size_t> _blocked;        //< producers waiting in wait()
+			std::atomic<std::size_t> _rejected;
+			std::mutex _mutex;
+			std::condition_variable _cv;
+			std::mutex _tickets_mutex;
+			std::deque<std::shared_ptr<Ticket>> _tickets; //< DropOldest only, oldest first
+		};
+
+	}
+
+	namespace detail {
+
+		struct TimerLink {
+			TimerLink * prev;
+			TimerLink * next;
+		};
+
+		class TimerWheel;
+
+		// One timer. Referenced by the wheel while armed or running and by
+		// each TimerHandle; state only changes under the wheel's mutex.
+		struct TimerNode : TimerLink {
+			enum State { Armed, Running, Fired, Cancelled };
+
+			std::uint64_t expires;  //< tick
+			std::uint64_t period;   //< ticks, 0 for one-shot timers
+			std::atomic<unsigned> refs;
+			std::atomic<int> state;
+			std::atomic<TimerWheel *> wheel; //< null once the wheel is done with it
+			Task task;
+		};
+
+		// A hashed hierarchical timing wheel with 1 ms ticks: level L has 256
+		// slots of 256^L ticks each, holding timers due within 256^(L+1) ticks.
+		// Slots are intrusive lists, so adding and cancelling a timer is O(1).
+		// Each time a level wraps, the next slot of the level above is spread
+		// over the levels below. The wheel's thread sleeps until the next
+		// non-empty level-0 slot or cascade and passes due tasks to sink.
+		class TimerWheel {
+		public:
+			typedef std::chrono::steady_clock clock;
+			typedef std::chrono::milliseconds tick;
+
+			static const unsigned level_bits = 8;
+			static const std::size_t levels = 4;
+			static const std::uint64_t slot_mask = (1u << level_bits) - 1;
+
+			explicit TimerWheel(std::function<void (Task &&)> sink)
+				: _sink(std::move(sink)), _origin(clock::now()), _now(0), _wake(no_wake), _size(0),
+				_enabled(false), _stopping(false) {
+				for (auto & level : _slots) {
+					for (TimerLink & slot : level) {
+						slot.prev = slot.next = &slot;
+					}
+				}
+			}
+
+			~TimerWheel() {
+				stop();
+				for (auto & level : _slots) {
+					for (TimerLink & slot : level) {
+						while (slot.next != &slot) {
+							TimerNode * node = static_cast<TimerNode *>(slot.next);
+							unlink(node);
+							retire(node, TimerNode::Cancelled);
+							release(node);
+						}
+					}
+				}
+			}
+
+			TimerWheel(const TimerWheel &) = delete;
+			TimerWheel & operator=(const TimerWheel &) = delete;
+
+			// Arms task for `when`, then every `period` if that is nonzero.
+			// Returns the node with one reference for the caller.
+			TimerNode * add(Task && task, clock::time_point when, clock::duration period) {
+				TimerNode * node = new (BlockCache::allocate(sizeof(TimerNode))) TimerNode();
+				node->task = std::move(task);
+				node->expires = ticks(when - _origin);
+				node->period = period.count() > 0 ? std::max<std::uint64_t>(ticks(period), 1) : 0;
+				node->refs.store(2, std::memory_order_relaxed);
+				node->wheel.store(this, std::memory_order_relaxed);
+				std::unique_lock<std::mutex> lock(_mutex);
+				catch_up();
+				if (node->expires <= _now) {
+					if (node->period == 0) {
+						Task due(std::move(node->task));
+						retire(node, TimerNode::Fired);
+						lock.unlock();
+						release(node);
+						_sink(std::move(due));
+						return node;
+					}
+					node->expires = _now + node->period;
+				}
+				arm(node);
+				return node;
+			}
+
+			// True if the timer was stopped before it ran, or, for a periodic
+			// one, before it ran again.
+			static bool cancel(TimerNode * node) {
+				TimerWheel * wheel = node->wheel.load(std::memory_order_acquire);
+				if (!wheel) {
+					return false;
+				}
+				Task task;
+				std::unique_lock<std::mutex> lock(wheel->_mutex);
+				switch (node->state.load(std::memory_order_relaxed)) {
+				case TimerNode::Armed:
+					wheel->unlink(node);
+					task = std::move(node->task);
+					retire(node, TimerNode::Cancelled);
+					lock.unlock();
+					release(node);
+					return true;
+				case TimerNode::Running:
+					node->state.store(TimerNode::Cancelled, std::memory_order_relaxed);
+					return true;
+				default:
+					return false;
+				}
+			}
+
+			static void retain(TimerNode * node) {
+				node->refs.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			static void release(TimerNode * node) {
+				if (node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					node->~TimerNode();
+					BlockCache::deallocate(node, sizeof(TimerNode));
+				}
+			}
+
+			// Armed timers.
+			std::size_t size() const {
+				std::lock_guard<std::mutex> lock(_mutex);
+				return _size;
+			}
+
+			// The thread starts with the first timer after start().
+			void start() {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_enabled = true;
+				if (_size != 0) {
+					spawn();
+				}
+			}
+
+			void stop() {
+				std::thread thread;
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_enabled = false;
+					_stopping = true;
+					thread.swap(_thread);
+				}
+				_cv.notify_all();
+				if (thread.joinable()) {
+					thread.join();
+				}
+			}
+
+		private:
+			static const std::uint64_t no_wake = ~std::uint64_t(0);
+
+			// Rounds up, so that no timer fires early.
+			static std::uint64_t ticks(clock::duration d) {
+				if (d.count() <= 0) {
+					return 0;
+				}
+				return static_cast<std::uint64_t>((d + tick(1) - clock::duration(1)) / tick(1));
+			}
+
+			// Runs a periodic timer's task, then re-arms it; holds the wheel's
+			// reference meanwhile.
+			struct PeriodicRun {
+				PeriodicRun(TimerWheel * w, TimerNode * n) : wheel(w), node(n) {}
+				PeriodicRun(PeriodicRun && other) noexcept : wheel(other.wheel), node(other.node) {
+					other.node = nullptr;
+				}
+				~PeriodicRun() {
+					if (node) {
+						{
+							std::lock_guard<std::mutex> lock(wheel->_mutex);
+							retire(node, TimerNode::Cancelled);
+						}
+						release(node);
+					}
+				}
+				void operator()() {
+					struct Rearm {
+						PeriodicRun & run;
+						~Rearm() {
+							run.wheel->rearm(run.node);
+							run.node = nullptr;
+						}
+					} rearm = { *this };
+					node->task();
+				}
+				TimerWheel * wheel;
+				TimerNode * node;
+			};
+
+			static void retire(TimerNode * node, TimerNode::State state) {
+				node->state.store(state, std::memory_order_relaxed);
+				node->wheel.store(nullptr, std::memory_order_release);
+			}
+
+			void rearm(TimerNode * node) {
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (node->state.load(std::memory_order_relaxed) == TimerNode::Running) {
+					catch_up();
+					node->expires = std::max(node->expires + node->period, _now + 1);
+					arm(node);
+					return;
+				}
+				retire(node, TimerNode::Cancelled);
+				lock.unlock();
+				release(node);
+			}
+
+			void arm(TimerNode * node) {
+				node->state.store(TimerNode::Armed, std::memory_order_relaxed);
+				link(node);
+				if (_enabled && !_thread.joinable()) {
+					spawn();
+				}
+				if (node->expires < _wake) {
+					_cv.notify_one();
+				}
+			}
+
+			// Due in less than 256^(L+1) ticks goes on level L. Beyond the last
+			// level a timer is parked as far out as it can go and re-linked
+			// when that slot comes up.
+			void link(TimerNode * node) {
+				std::uint64_t delta = node->expires - _now;
+				std::uint64_t expires = node->expires;
+				if (delta >> (level_bits * levels)) {
+					delta = (std::uint64_t(1) << (level_bits * levels)) - 1;
+					expires = _now + delta;
+				}
+				std::size_t level = 0;
+				while (delta >> (level_bits * (level + 1))) {
+					++level;
+				}
+				TimerLink & slot = _slots[level][(expires >> (level_bits * level)) & slot_mask];
+				node->prev = &slot;
+				node->next = slot.next;
+				slot.next->prev = node;
+				slot.next = node;
+				++_size;
+			}
+
+			void unlink(TimerNode * node) {
+				node->prev->next = node->next;
+				node->next->prev = node->prev;
+				--_size;
+			}
+
+			std::uint64_t elapsed() const {
+				return static_cast<std::uint64_t>((clock::now() - _origin) / tick(1));
+			}
+
+			// An empty wheel has no ticks to process: it jumps to the present
+			// instead of replaying, under the lock, every tick it slept through.
+			void catch_up() {
+				if (_size == 0) {
+					_now = std::max(_now, elapsed());
+				}
+			}
+
+			// Moves the wheel on by one tick, collecting the tasks now due.
+			void advance(std::vector<Task> & due) {
+				++_now;
+				for (std::size_t level = 1; level < levels; ++level) {
+					if (_now & ((std::uint64_t(1) << (level_bits * level)) - 1)) {
+						break;
+					}
+					TimerLink & slot = _slots[level][(_now >> (level_bits * level)) & slot_mask];
+					while (slot.next != &slot) {
+						TimerNode * node = static_cast<TimerNode *>(slot.next);
+						unlink(node);
+						link(node);
+					}
+				}
+				TimerLink & slot = _slots[0][_now & slot_mask];
+				while (slot.next != &slot) {
+					TimerNode * node = static_cast<TimerNode *>(slot.next);
+					unlink(node);
+					if (node->expires > _now) {
+						link(node);
+						continue;
+					}
+					if (node->period == 0) {
+						due.push_back(std::move(node->task));
+						retire(node, TimerNode::Fired);
+						release(node);
+					}
+					else {
+						node->state.store(TimerNode::Running, std::memory_order_relaxed);
+						due.push_back(Task(PeriodicRun(this, node)));
+					}
+				}
+			}
+
+			// The next tick with level-0 timers, or the next cascade.
+			std::uint64_t next_tick() const {
+				std::uint64_t cascade = (_now | slot_mask) + 1;
+				for (std::uint64_t t = _now + 1; t < cascade; ++t) {
+					const TimerLink & slot = _slots[0][t & slot_mask];
+					if (slot.next != &slot) {
+						return t;
+					}
+				}
+				return cascade;
+			}
+
+			void spawn() {
+				_stopping = false;
+				_thread = std::thread([this] () { run(); });
+			}
+
+			void run() {
+				std::vector<Task> due;
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (!_stopping) {
+					std::uint64_t now = elapsed();
+					while (_now < now && _size != 0) {
+						advance(due);
+					}
+					_now = std::max(_now, now);
+					if (!due.empty()) {
+						lock.unlock();
+						for (Task & task : due) {
+							_sink(std::move(task));
+						}
+						due.clear();
+						lock.lock();
+						continue;
+					}
+					if (_size == 0) {
+						_wake = no_wake;
+						_cv.wait(lock);
+					}
+					else {
+						_wake = next_tick();
+						_cv.wait_until(lock, _origin + tick(_wake));
+					}
+				}
+				_wake = no_wake;
+			}
+
+			const std::function<void (Task &&)> _sink;
+			const clock::time_point _origin;
+			mutable std::mutex _mutex;
+			std::condition_variable _cv;
+			std::uint64_t _now;   //< last tick processed
+			std::uint64_t _wake;  //< tick the thread sleeps until
+			std::size_t _size;
+			bool _enabled;
+			bool _stopping;
+			TimerLink _slots[levels][std::size_t(1) << level_bits];
+			std::thread _thread;
+		};
+
+	}
+
+	// Returned by ThreadPool::schedule_after(), schedule_at() and
+	// schedule_every(). Copies refer to the same timer, and a handle may
+	// outlive its pool.
+	class TimerHandle {
+	public:
+		TimerHandle() noexcept : _node(nullptr) {}
+
+		explicit TimerHandle(detail::TimerNode * node) noexcept : _node(node) {}
+
+		TimerHandle(const TimerHandle & other) noexcept : _node(other._node) {
+			if (_node) {
+				detail::TimerWheel::retain(_node);
+			}
+		}
+
+		TimerHandle(TimerHandle && other) noexcept : _node(other._node) {
+			other._node = nullptr;
+		}
+
+		TimerHandle & operator=(TimerHandle other) noexcept {
+			std::swap(_node, other._node);
+			return *this;
+		}
+
+		~TimerHandle() {
+			if (_node) {
+				detail::TimerWheel::release(_node);
+			}
+		}
+
+		// True if this call kept the task from running, or, for a periodic
+		// timer, from running again. A run in progress is not interrupted.
+		bool cancel() {
+			return _node && detail::TimerWheel::cancel(_node);
+		}
+
+		// Until a one-shot timer has fired, or any timer was cancelled.
+		bool pending() const {
+			if (!_node) {
+				return false;
+			}
+			int state = _node->state.load(std::memory_order_relaxed);
+			return state == detail::TimerNode::Armed || state == detail::TimerNode::Running;
+		}
+
+	private:
+		detail::TimerNode * _node;
+	};
+
+	// Scratch memory for the task running on this thread: a pointer bump in
+	// a per-thread arena, with nothing to free. All of it is released when
+	// the task returns, so it must not outlive the task. Outside pool tasks,
+	// a ScratchScope bounds it the same way.
+	inline void * scratch_allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t)) {
+		return detail::ScratchArena::local().allocate(size, alignment);
+	}
+
+	typedef detail::ScratchArena::Scope ScratchScope;
+
+	// Puts a container's storage in scratch memory; deallocate() is a no-op.
+	template<typename T>
+	class ScratchAllocator {
+	public:
+		typedef T value_type;
+
+		ScratchAllocator() noexcept {}
+
+		template<typename U>
+		ScratchAllocator(const ScratchAllocator<U> &) noexcept {}
+
+		T * allocate(std::size_t n) {
+			return static_cast<T *>(scratch_allocate(n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T *, std::size_t) noexcept {}
+
+		template<typename U>
+		bool operator==(const ScratchAllocator<U> &) const noexcept { return true; }
+
+		template<typename U>
+		bool operator!=(const ScratchAllocator<U> &) const noexcept { return false; }
+	};
+
+	// Polled by tasks that should give up early once their work is no longer
+	// wanted; nothing is interrupted. A default-constructed token is never
+	// cancelled.
+	class CancellationToken {
+	public:
+		CancellationToken() {}
+
+		bool is_cancelled() const {
+			return _flag && _flag->load(std::memory_order_acquire);
+		}
+
+	private:
+		friend class CancellationSource;
+
+		explicit CancellationToken(const std::shared_ptr<std::atomic<bool>> & flag) : _flag(flag) {}
+
+		std::shared_ptr<std::atomic<bool>> _flag;
+	};
+
+	// Hands out tokens that all see one cancel().
+	class CancellationSource {
+	public:
+		CancellationSource() : _flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+		CancellationToken token() const {
+			return CancellationToken(_flag);
+		}
+
+		void cancel() {
+			_flag->store(true, std::memory_order_release);
+		}
+
+		bool is_cancelled() const {
+			return _flag->load(std::memory_order_acquire);
+		}
+
+	private:
+		std::shared_ptr<std::atomic<bool>> _flag;
+	};
+
+	class SerialExecutor;
+
+	// Runs tasks on whichever thread calls run() or drain(), typically the
+	// main thread: completion notices, errors rethrown from workers,
+	// stopMainIoService(). Producers push onto a lock-free list; the push that
+	// finds it empty wakes the consumer through an eventfd where there is one
+	// (a condition variable otherwise), so a thread with its own epoll loop
+	// can watch native_handle() and call drain() when it is readable.
+	class MainExecutor {
+	public:
+		static const std::size_t no_limit = static_cast<std::size_t>(-1);
+
+		MainExecutor() : _tail(new_node(Task())), _head(_tail), _queued(0), _stopped(false),
+			_fd(-1), _signalled(false) {
+#ifdef __linux__
+			_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+		}
+
+		MainExecutor(const MainExecutor &) = delete;
+		MainExecutor & operator=(const MainExecutor &) = delete;
+
+		// Tasks never run are destroyed.
+		~MainExecutor() {
+			while (_tail) {
+				Node * next = _tail->next.load(std::memory_order_relaxed);
+				delete_node(_tail);
+				_tail = next;
+			}
+#ifdef __linux__
+			if (_fd >= 0) {
+				::close(_fd);
+			}
+#endif
+		}
+
+		template<typename T> // T must be "void handler()""
+		void post(T && f) {
+			Node * node = new_node(Task(std::forward<T>(f)));
+			Node * prev = _head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+			if (_queued.fetch_add(1, std::memory_order_acq_rel) == 0) {
+				signal();
+			}
+		}
+
+		// Runs f at once when called from inside run() or drain(), else posts it.
+		template<typename T> // T must be "void handler()""
+		void dispatch(T && f) {
+			if (running_in_this_thread()) {
+				f();
+				return;
+			}
+			post(std::forward<T>(f));
+		}
+
+		bool running_in_this_thread() const {
+			return current() == this;
+		}
+
+		// Runs up to max queued tasks on this thread without blocking and
+		// returns how many ran. Tasks are taken in batches of whatever is
+		// queued, one atomic update per batch. A throwing task propagates out;
+		// the rest stay queued. Calls must not overlap.
+		std::size_t drain(std::size_t max = no_limit) {
+			Current scope(this);
+			clear();
+			Batch batch = { *this, 0, 0 };
+			while (batch.done < max) {
+				std::size_t queued = _queued.load(std::memory_order_acquire);
+				if (queued == 0) {
+					break;
+				}
+				std::size_t count = std::min(queued, max - batch.done);
+				for (batch.taken = 0; batch.taken < count; ) {
+					Task task = pop();
+					++batch.taken;
+					detail::ScratchArena::Scope scratch;
+					task();
+				}
+				batch.settle();
+			}
+			return batch.done;
+		}
+
+		// Runs tasks as they arrive until stop() is called, then returns once
+		// the queue is empty. A stop() before run() is kept for it.
+		void run() {
+			for (;;) {
+				drain();
+				if (_stopped.load(std::memory_order_acquire) && _queued.load(std::memory_order_acquire) == 0) {
+					break;
+				}
+				wait();
+			}
+			_stopped.store(false, std::memory_order_relaxed);
+		}
+
+		void stop() {
+			_stopped.store(true, std::memory_order_release);
+			signal();
+		}
+
+		// Readable while tasks are queued, for an external epoll or poll loop;
+		// -1 without eventfd support.
+		int native_handle() const {
+			return _fd;
+		}
+
+		std::size_t pending() const {
+			return _queued.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct Node {
+			explicit Node(Task && t) : next(nullptr), task(std::move(t)) {}
+			std::atomic<Node *> next;
+			Task task;
+		};
+
+		struct Current {
+			explicit Current(const MainExecutor * executor) : saved(current()) {
+				current() = executor;
+			}
+			~Current() {
+				current() = saved;
+			}
+			const MainExecutor * saved;
+		};
+
+		// Retires the tasks taken so far in one update, also when one throws,
+		// and signals again if tasks are left for a later drain().
+		struct Batch {
+			~Batch() {
+				settle();
+				if (executor._queued.load(std::memory_order_acquire) != 0) {
+					executor.signal();
+				}
+			}
+			void settle() {
+				if (taken != 0) {
+					executor._queued.fetch_sub(taken, std::memory_order_acq_rel);
+					done += taken;
+					taken = 0;
+				}
+			}
+			MainExecutor & executor;
+			std::size_t done;
+			std::size_t taken;
+		};
+
+		static const MainExecutor *& current() {
+			static thread_local const MainExecutor * executor = nullptr;
+			return executor;
+		}
+
+		static Node * new_node(Task && task) {
+			return new (detail::BlockCache::allocate(sizeof(Node))) Node(std::move(task));
+		}
+
+		static void delete_node(Node * node) {
+			node->~Node();
+			detail::BlockCache::deallocate(node, sizeof(Node));
+		}
+
+		// As SerialExecutor::pop(): a counted push may not have linked its node yet.
+		Task pop() {
+			Node * next = _tail->next.load(std::memory_order_acquire);
+			while (!next) {
+				detail::cpu_relax();
+				next = _tail->next.load(std::memory_order_acquire);
+			}
+			Task task(std::move(next->task));
+			delete_node(_tail);
+			_tail = next;
+			return task;
+		}
+
+		void signal() {
+#ifdef __linux__
+			if (_fd >= 0) {
+				std::uint64_t one = 1;
+				ssize_t written = ::write(_fd, &one, sizeof(one));
+				(void)written;
+				return;
+			}
+#endif
+			std::lock_guard<std::mutex> lock(_mutex);
+			_signalled = true;
+			_cv.notify_one();
+		}
+
+		void clear() {
+#ifdef __linux__
+			if (_fd >= 0) {
+				std::uint64_t count;
+				ssize_t bytes = ::read(_fd, &count, sizeof(count));
+				(void)bytes;
+				return;
+			}
+#endif
+			std::lock_guard<std::mutex> lock(_mutex);
+			_signalled = false;
+		}
+
+		void wait() {
+#ifdef __linux__
+			if (_fd >= 0) {
+				pollfd ready = { _fd, POLLIN, 0 };
+				::poll(&ready, 1, -1);
+				return;
+			}
+#endif
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cv.wait(lock, [this] () { return _signalled; });
+		}
+
+		Node * _tail;                //< consumer side
+		std::atomic<Node *> _head;   //< last pushed node
+		std::atomic<std::size_t> _queued;
+		std::atomic<bool> _stopped;
+		int _fd;                     //< eventfd, or -1
+		std::mutex _mutex;           //< with _cv and _signalled, when there is no eventfd
+		std::condition_variable _cv;
+		bool _signalled;
+	};
+
+
+	class ThreadPool : private detail::Helper {
+	public:
+		ThreadPool(size_t threads = default_thread_count(),
+			SchedulerMode mode = SchedulerMode::Asio) 
+			:  ThreadPool(makeOptions(threads, mode)) {
+		}
+
+		explicit ThreadPool(const ThreadPoolOptions & options)
+			:  _thread_size(std::max<size_t>(options.threads, 1)), _mode(options.mode),
+			_topology(options.topology.nodes.empty() ? CpuTopology::detect() : options.topology),
+			_node_count(1), _next_node(0), _tracker(this, _thread_size),
+			_admission(options.max_in_flight, options.when_full, options.block_timeout),
+			_timers([this] (Task && task) { post(std::move(task)); }),
+			_lanes(options.dispatch, options.lane_weights, options.deadline_policy),
+			_route_through_lanes(options.priority_lanes), _strand(make_serial_executor()),
+			_elastic(options.elastic && std::max<size_t>(options.min_threads, 1) < _thread_size),
+			_min_threads(_elastic ? std::max<size_t>(options.min_threads, 1) : _thread_size),
+			_grow_after(options.grow_after), _retire_after(options.retire_after),
+			_spin(options.spin_before_park), _on_error(options.on_error), _active(0), _queued(0),
+			_worker_running(new std::atomic<bool>[_thread_size]), _supervising(false), _probe_pending(false) {
+			for (size_t i = 0; i < _thread_size; ++i) {
+				_worker_running[i].store(false, std::memory_order_relaxed);
+			}
+			_placements = detail::plan_placement(options, _topology, _node_count);
+			if (_mode == SchedulerMode::WorkStealing) {
+				std::vector<std::size_t> worker_nodes;
+				for (auto & placement : _placements) {
+					worker_nodes.push_back(placement.node);
+				}
+				_scheduler.reset(new detail::WorkStealingScheduler(_tracker, worker_nodes, _node_count));
+			}
+			else if (_mode == SchedulerMode::BoundedRing) {
+				_scheduler.reset(new detail::RingScheduler(_tracker, options.queue_capacity, options.when_full,
+					options.block_timeout));
+			}
+			else {
+				for (std::size_t node = 1; node < _node_count; ++node) {
+					_node_services.emplace_back(new asio::io_service());
+				}
+			}
+#if PMCONCURRENCY_METRICS
+			_metrics.reset(new detail::MetricsRecorder(this, _thread_size));
+#endif
+#if PMCONCURRENCY_TRACING
+			if (options.trace_capacity != 0) {
+				_trace.reset(new detail::TraceRecorder(this, _thread_size, options.trace_capacity));
+			}
+#endif
+		}
+
+		~ThreadPool() {
+			stopSupervisor();
+			_timers.stop();
+			_work.clear(); //stop all, allow run() to exit
+			if (_scheduler) {
+				_scheduler->stop();
+			}
+			
+			for (auto& thread : _group) {
+      			if (thread.joinable()) {
+      				thread.join();
+      			}
+  			}
+		}
+
+		// With ThreadPoolOptions::max_in_flight set, a task that finds the limit
+		// reached is handled per ThreadPoolOptions::when_full: f may block the
+		// caller, be dropped, run on the calling thread, or push out the oldest
+		// queued task.
+		template<typename T> // T must be "void handler()""
+		void enqueue(T && f) {
+			Task task(std::forward<T>(f));
+			if (admit(task)) {
+				post(std::move(task));
+			}
+		}
+
+		// Queues f only if that needs no waiting, dropping or running it here,
+		// neither under max_in_flight nor on a full BoundedRing; otherwise
+		// counts a rejection and returns false.
+		template<typename T> // T must be "void handler()""
+		bool try_enqueue(T && f) {
+			Task task(std::forward<T>(f));
+			if (_admission.enabled()) {
+				if (!_admission.try_acquire()) {
+					_admission.reject();
+					return false;
+				}
+				task = _admission.wrap(std::move(task));
+			}
+			if (!tryPost(std::move(task))) {
+				_admission.reject(); //< the slot went with the task
+				return false;
+			}
+			return true;
+		}
+
+		// Queues f in the given priority lane.
+		template<typename T> // T must be "void handler()""
+		void enqueue(Priority priority, T && f) {
+			Task task(std::forward<T>(f));
+			if (admit(task)) {
+				postToLane(std::move(task), priority);
+			}
+		}
+
+		// As above; if f has not started by the deadline it is dropped or
+		// promoted to Priority::High, per ThreadPoolOptions::deadline_policy.
+		template<typename T> // T must be "void handler()""
+		void enqueue(Priority priority, std::chrono::steady_clock::time_point deadline, T && f) {
+			Task task(std::forward<T>(f));
+			if (admit(task)) {
+				_lanes.push(std::move(task), priority, deadline);
+				postBackend(Task([this] () { runLaneTask(); }));
+			}
+		}
+
+		// Runs f(args...) on the pool and returns a future for its result.
+		// Move-only callables and arguments are accepted. A task rejected under
+		// max_in_flight leaves the future with a broken_promise error.
+		template<typename F, typename... Args>
+		Future<detail::invoke_result_t<typename std::decay<F>::type, typename std::decay<Args>::type...>>
+		submit(F && f, Args &&... args) {
+			typedef detail::invoke_result_t<typename std::decay<F>::type, typename std::decay<Args>::type...> R;
+			static_assert(!std::is_reference<R>::value, "submit() does not support reference results");
+			typedef detail::TaskState<R, typename std::decay<F>::type, typename std::decay<Args>::type...> State;
+
+			State * state = State::create(std::forward<F>(f), std::forward<Args>(args)...);
+			state->set_helper(this);
+			Future<R> future(state);
+			Task task = detail::TaskRunner<State>(state);
+			if (admit(task)) {
+				post(std::move(task));
+			}
+			return future;
+		}
+
+		// submit() through the given priority lane.
+		template<typename F, typename... Args>
+		Future<detail::invoke_result_t<typename std::decay<F>::type, typename std::decay<Args>::type...>>
+		submit(Priority priority, F && f, Args &&... args) {
+			typedef detail::invoke_result_t<typename std::decay<F>::type, typename std::decay<Args>::type...> R;
+			static_assert(!std::is_reference<R>::value, "submit() does not support reference results");
+			typedef detail::TaskState<R, typename std::decay<F>::type, typename std::decay<Args>::type...> State;
+
+			State * state = State::create(std::forward<F>(f), std::forward<Args>(args)...);
+			state->set_helper(this);
+			Future<R> future(state);
+			Task task = detail::TaskRunner<State>(state);
+			if (admit(task)) {
+				postToLane(std::move(task), priority);
+			}
+			return future;
+		}
+		
+		// Runs f after, and never concurrently with, everything strand()ed
+		// before it. One serial executor shared by all callers; give each
+		// independent sequence its own make_serial_executor() instead.
+		template<typename T> // T must be "void handler()""
+		void strand(T && f);
+
+		// A new serial executor running on this pool's workers. Executors are
+		// cheap, so one per session or actor is fine, and independent
+		// executors run in parallel.
+		std::shared_ptr<SerialExecutor> make_serial_executor();
+
+		// Queues every callable in [first, last) in one batch: the queue is
+		// synchronized once per batch rather than once per task, and at most one
+		// worker per task is woken.
+		template<typename Iterator>
+		void enqueue_bulk(Iterator first, Iterator last) {
+			std::vector<Task> tasks;
+			for (; first != last; ++first) {
+				tasks.emplace_back(*first);
+			}
+			enqueueBulk(std::move(tasks));
+		}
+
+		template<typename Range>
+		void enqueue_bulk(Range && range) {
+			using std::begin;
+			using std::end;
+			enqueue_bulk(begin(range), end(range));
+		}
+
+		// Batch-queues the callables gen(0) ... gen(count - 1).
+		template<typename Generator>
+		void enqueue_n(size_t count, Generator gen) {
+			std::vector<Task> tasks;
+			tasks.reserve(count);
+			for (size_t i = 0; i < count; ++i) {
+				tasks.emplace_back(gen(i));
+			}
+			enqueueBulk(std::move(tasks));
+		}
+
+		// Like enqueue(), but queues f on the given NUMA sub-pool
+		// (0 <= node < get_node_count()); a hint only without NUMA sub-pools.
+		template<typename T> // T must be "void handler()""
+		void enqueue_on_node(size_t node, T && f) {
+			Task task(std::forward<T>(f));
+			if (admit(task)) {
+				postOnNode(std::move(task), node % _node_count);
+			}
+		}
+
+		// Queues f once delay has passed. Timers tick every millisecond and
+		// never fire early; they only fire while the pool is started.
+		template<typename Rep, typename Period, typename T> // T must be "void handler()""
+		TimerHandle schedule_after(std::chrono::duration<Rep, Period> delay, T && f) {
+			return schedule_at(std::chrono::steady_clock::now() + delay, std::forward<T>(f));
+		}
+
+		template<typename T> // T must be "void handler()""
+		TimerHandle schedule_at(std::chrono::steady_clock::time_point when, T && f) {
+			return TimerHandle(_timers.add(Task(std::forward<T>(f)), when, std::chrono::steady_clock::duration::zero()));
+		}
+
+		// Queues f every period, the first time one period from now. A run
+		// that is late skips the missed periods, and runs never overlap.
+		template<typename Rep, typename Period, typename T> // T must be "void handler()""
+		TimerHandle schedule_every(std::chrono::duration<Rep, Period> period, T && f) {
+			typedef std::chrono::steady_clock::duration duration;
+			return TimerHandle(_timers.add(Task(std::forward<T>(f)), std::chrono::steady_clock::now() + period,
+				std::max(std::chrono::duration_cast<duration>(period), duration(1))));
+		}
+
+#if PMCONCURRENCY_HAS_COROUTINES
+		struct ScheduleAwaiter {
+			ThreadPool & pool;
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> handle) {
+				pool.post(Task([handle] () { handle.resume(); }));
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		// co_await pool.schedule() resumes the coroutine on one of the workers.
+		ScheduleAwaiter schedule() {
+			return ScheduleAwaiter{ *this };
+		}
+#endif
+
+		// Only serviced by the workers in SchedulerMode::Asio (sub-pool 0 with NUMA).
+		asio::io_service & get_io_service() {
+			return _io_service;
+		}
+		
+		// The number of worker slots; the upper bound of an elastic pool.
+		size_t get_thread_size() {
+			return _thread_size;
+		}
+
+		// Workers currently running; below get_thread_size() only when elastic.
+		size_t get_active_threads() const {
+			return _active.load(std::memory_order_relaxed);
+		}
+
+		static const size_t no_worker = static_cast<size_t>(-1);
+
+		// Index of the calling thread among this pool's workers, or no_worker.
+		size_t get_worker_index() const {
+			const detail::WorkerIdentity & identity = detail::current_worker();
+			if (identity.pool == this) {
+				return identity.index;
+			}
+			return no_worker;
+		}
+
+		SchedulerMode get_scheduler_mode() const {
+			return _mode;
+		}
+
+		size_t get_node_count() const {
+			return _node_count;
+		}
+
+		const CpuTopology & get_topology() const {
+			return _topology;
+		}
+
+		// Counters and latency histograms since construction; all zero when
+		// built with PMCONCURRENCY_METRICS=0.
+		ThreadPoolMetrics metrics() const {
+			ThreadPoolMetrics metrics;
+#if PMCONCURRENCY_METRICS
+			_metrics->snapshot(metrics);
+#else
+			metrics.workers.resize(_thread_size);
+#endif
+			return metrics;
+		}
+
+		// The task runs recorded since the last call, as far as the per-thread
+		// rings of ThreadPoolOptions::trace_capacity entries still hold them,
+		// in start order. Empty when tracing is off.
+		std::vector<TraceEvent> flush_trace() {
+			std::vector<TraceEvent> events;
+#if PMCONCURRENCY_TRACING
+			if (_trace) {
+				_trace->flush(events);
+			}
+#endif
+			std::sort(events.begin(), events.end(), [] (const TraceEvent & a, const TraceEvent & b) {
+				return a.started < b.started;
+			});
+			return events;
+		}
+
+		// flush_trace() in the Chrome trace event format, which chrome://tracing
+		// and the Perfetto UI load: a track per thread, a slice per task, with
+		// its time in the queue as an argument. Times are in microseconds from
+		// the earliest enqueue.
+		void write_chrome_trace(std::ostream & out) {
+			std::vector<TraceEvent> events = flush_trace();
+			std::chrono::steady_clock::time_point origin = events.empty() ? std::chrono::steady_clock::time_point()
+				: events.front().enqueued;
+			std::vector<bool> named;
+			for (const TraceEvent & event : events) {
+				origin = std::min(origin, event.enqueued);
+				if (event.thread >= named.size()) {
+					named.resize(event.thread + 1, false);
+				}
+				named[event.thread] = true;
+			}
+
+			char buffer[160];
+			const char * separator = "\n";
+			out << "{\"traceEvents\":[";
+			for (size_t thread = 0; thread < named.size(); ++thread) {
+				if (named[thread]) {
+					std::snprintf(buffer, sizeof(buffer),
+						"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s %zu\"}}",
+						separator, thread, thread < _thread_size ? "worker" : "thread", thread);
+					out << buffer;
+					separator = ",\n";
+				}
+			}
+			for (const TraceEvent & event : events) {
+				out << separator << "{\"name\":";
+				writeJsonString(out, event.label ? event.label : "task");
+				std::snprintf(buffer, sizeof(buffer),
+					",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"queued_us\":%.3f}}",
+					event.thread, micros(event.started - origin), micros(event.finished - event.started),
+					micros(event.started - event.enqueued));
+				out << buffer;
+				separator = ",\n";
+			}
+			out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+		}
+
+		// Tasks turned away or dropped under max_in_flight or by a full
+		// BoundedRing, and try_enqueue() calls that returned false.
+		size_t get_rejected_count() const {
+			return _admission.rejected() + (_scheduler ? _scheduler->rejected() : 0);
+		}
+
+		// Tasks holding a max_in_flight slot; always 0 without a limit.
+		size_t get_in_flight_count() const {
+			return _admission.in_flight();
+		}
+
+		// Tasks discarded under DeadlinePolicy::Drop.
+		size_t get_dropped_count() const {
+			return _lanes.dropped();
+		}
+
+		void start() {
+			{
+				std::lock_guard<std::mutex> lock(_cancel_mutex);
+				if (_cancellation.is_cancelled()) {
+					_cancellation = CancellationSource();
+				}
+			}
+			if (_scheduler) {
+				_scheduler->restart();
+			}
+			else {
+				for (std::size_t node = 0; node < _node_count; ++node) {
+					asio::io_service & service = nodeService(node);
+					if(service.stopped()) {
+						service.reset();
+					}
+					_work.emplace_back(new asio::io_service::work(service));
+				}
+			}
+			_group.clear();
+			_group.resize(_thread_size);
+			for (std::size_t i = 0; i < _min_threads; ++i) {
+				spawnWorker(i);
+			}
+			if (_elastic) {
+				_supervising = true;
+				_supervisor = std::thread([this] () { supervise(); });
+			}
+			_timers.start();
+		}
+
+		// Lets the workers finish everything queued, then joins them. Tasks
+		// queued while the pool is stopped run once it is started again.
+		void stop() {
+			stopSupervisor();
+			_timers.stop();
+			_work.clear();
+			if (_scheduler) {
+				_scheduler->stop();
+			}
+			joinWorkers();
+		}
+
+		// Waits until every task queued so far, and every task those queue,
+		// has run; false if timeout passes first. Timers not yet due do not
+		// count, and a task of this pool must not wait for it to be idle.
+		bool wait_idle(std::chrono::milliseconds timeout = std::chrono::milliseconds::max()) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (unsigned i = 0; !_tracker.idle(); ++i) {
+				if (timeout != std::chrono::milliseconds::max() && std::chrono::steady_clock::now() - start >= timeout) {
+					return false;
+				}
+				if (i < 64) {
+					std::this_thread::yield();
+				}
+				else {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			}
+			return true;
+		}
+
+		// Runs one queued task on the calling thread, which need not be a
+		// worker; false if none was found. Blocking waits on futures, task
+		// groups, graphs and parallel loops of this pool call it while they
+		// wait, so a task may wait on work it queued without tying up its
+		// worker, even on a one-thread pool. An exception the task throws is
+		// reported as from a worker.
+		bool run_pending_task() {
+			try {
+				if (_scheduler) {
+					return _scheduler->run_one();
+				}
+				size_t index = get_worker_index();
+				size_t first = index != no_worker ? _placements[index].node : 0;
+				for (size_t i = 0; i < _node_count; ++i) {
+					if (nodeService((first + i) % _node_count).poll_one() != 0) {
+						return true;
+					}
+				}
+				return false;
+			}
+			catch(...) {
+				reportError(std::current_exception());
+				return true;
+			}
+		}
+
+		// Stops timers firing, waits for the pool to go idle and stops it. If
+		// that takes longer than timeout, the rest is cancelled as by
+		// shutdown_now() and false is returned.
+		bool shutdown(std::chrono::milliseconds timeout = std::chrono::milliseconds::max()) {
+			_timers.stop();
+			if (!wait_idle(timeout)) {
+				shutdown_now();
+				return false;
+			}
+			stop();
+			return true;
+		}
+
+		// Stops the pool without running what is still queued. The pool's
+		// cancellation token is cancelled, running tasks are waited for, and
+		// queued ones are destroyed unrun: futures from submit() report
+		// broken_promise and TaskGraph runs and parallel_for calls they belong
+		// to fail the same way. Timers stay armed for the next start(), and in
+		// SchedulerMode::Asio handlers posted straight to get_io_service() are
+		// run on this thread.
+		void shutdown_now() {
+			{
+				std::lock_guard<std::mutex> lock(_cancel_mutex);
+				_cancellation.cancel();
+			}
+			stopSupervisor();
+			_timers.stop();
+			_work.clear();
+			if (_scheduler) {
+				_scheduler->abort();
+			}
+			else {
+				for (std::size_t node = 0; node < _node_count; ++node) {
+					nodeService(node).stop();
+				}
+			}
+			joinWorkers();
+			discardQueued();
+		}
+
+		// Cancelled by shutdown_now(), or by a shutdown() that timed out;
+		// tokens taken after the next start() are fresh.
+		CancellationToken get_cancellation_token() {
+			std::lock_guard<std::mutex> lock(_cancel_mutex);
+			return _cancellation.token();
+		}
+
+		// Posts f to the main executor.
+		template<typename T>
+		void enqueueMainIoService(T && f) {
+			_main_executor.post(std::forward<T>(f));
+		}
+
+		// Runs the main executor on this thread until stopMainIoService().
+		void startMainIoService() {
+			_main_executor.run();
+		}
+
+		void stopMainIoService() {
+			_main_executor.stop();
+		}
+
+		// Where completions and rethrown errors are marshalled to; drive it
+		// with startMainIoService(), or drain() it from an existing loop.
+		MainExecutor & get_main_executor() {
+			return _main_executor;
+		}
+
+		// Calls body(first, last) over sub-ranges of [begin, end) on the pool and
+		// the calling thread, returning once all of them have run. Sub-ranges
+		// are split lazily and their size adapts to the measured run time, but
+		// never drops below min_grain. The first exception thrown is rethrown.
+		template<typename Index, typename Body>
+		void parallel_for(Index begin, Index end, Body body, std::size_t min_grain = 1);
+
+		// As parallel_for, with body(first, last, acc) returning acc folded over
+		// [first, last). Partial results are merged in index order with
+		// combine(lhs, rhs), starting from identity.
+		template<typename Index, typename T, typename Body, typename Combine>
+		T parallel_reduce(Index begin, Index end, T identity, Body body, Combine combine,
+			std::size_t min_grain = 1);
+
+		std::string getThisThreadId() {
+    		std::ostringstream ss;
+    		ss << std::this_thread::get_id();
+    		return ss.str();
+		}
+
+		// Rethrows, once, the first exception that escaped a task since the
+		// last call, when there is no ThreadPoolOptions::on_error. Each one is
+		// also rethrown on the main executor.
+		void checkError() {
+			std::exception_ptr eptr;
+			{
+				std::lock_guard<std::mutex> lock(_error_mutex);
+				eptr.swap(_eptr);
+			}
+			if(eptr) {
+				std::rethrow_exception(eptr);
+			}
+		}
+
+
+	private:
+		friend class TaskGroup;
+		friend class TaskGraph;
+		friend class SerialExecutor;
+
+		static ThreadPoolOptions makeOptions(size_t threads, SchedulerMode mode) {
+			ThreadPoolOptions options;
+			options.threads = threads;
+			options.mode = mode;
+			return options;
+		}
+
+		static double micros(std::chrono::steady_clock::duration duration) {
+			return std::chrono::duration<double, std::micro>(duration).count();
+		}
+
+		static void writeJsonString(std::ostream & out, const char * text) {
+			out << '"';
+			for (; *text; ++text) {
+				unsigned char c = static_cast<unsigned char>(*text);
+				if (c == '"' || c == '\\') {
+					out << '\\' << *text;
+				}
+				else if (c < 0x20) {
+					char escaped[8];
+					std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+					out << escaped;
+				}
+				else {
+					out << *text;
+				}
+			}
+			out << '"';
+		}
+
+		asio::io_service & nodeService(size_t node) {
+			return node == 0 ? _io_service : *_node_services[node - 1];
+		}
+
+		bool help() override {
+			return run_pending_task();
+		}
+
+		detail::Helper * helper() {
+			return this;
+		}
+
+		// Holds task to max_in_flight. Returns false if it was refused, and
+		// destroyed, or has been run on this thread instead.
+		bool admit(Task & task) {
+			if (!_admission.enabled()) {
+				return true;
+			}
+			switch (_admission.acquire(get_worker_index() != no_worker)) {
+			case detail::Admission::Admitted:
+				task = _admission.wrap(std::move(task));
+				return true;
+			case detail::Admission::RunHere: {
+				Task run(std::move(task));
+				detail::ScratchArena::Scope scratch;
+				run();
+				return false;
+			}
+			default:
+				task.reset();
+				return false;
+			}
+		}
+
+		// Admits a batch task by task. Before a task waits or runs here, the
+		// ones admitted ahead of it are published: it may need their slots.
+		void enqueueBulk(std::vector<Task> && tasks) {
+			if (!_admission.enabled()) {
+				postBulk(std::move(tasks));
+				return;
+			}
+			std::vector<Task> admitted;
+			admitted.reserve(tasks.size());
+			for (Task & task : tasks) {
+				if (_admission.try_acquire()) {
+					admitted.push_back(_admission.wrap(std::move(task)));
+					continue;
+				}
+				postBulk(std::move(admitted));
+				admitted.clear();
+				if (admit(task)) {
+					admitted.push_back(std::move(task));
+				}
+			}
+			postBulk(std::move(admitted));
+		}
+
+		void post(Task && task) {
+			if (_route_through_lanes) {
+				postToLane(std::move(task), Priority::Normal);
+			}
+			else {
+				postBackend(std::move(task));
+			}
+		}
+
+		// As post(), but a full bounded queue makes it return false and destroy
+		// the task unrun.
+		bool tryPost(Task && task) {
+			if (!_route_through_lanes) {
+				return tryPostBackend(std::move(task));
+			}
+			std::uint64_t id = _lanes.push(std::move(task), Priority::Normal);
+			if (tryPostBackend(Task([this] () { runLaneTask(); }))) {
+				return true;
+			}
+			if (_lanes.withdraw(Priority::Normal, id)) {
+				return false;
+			}
+			// A runner posted for another task took this one, so that task
+			// still needs a runner of its own.
+			postBackend(Task([this] () { runLaneTask(); }));
+			return true;
+		}
+
+		// asio has no batch post, so the batch is shared by one drainer handler
+		// per worker that can help; each drainer claims tasks until none are left.
+		void postBulk(std::vector<Task> && tasks) {
+			if (tasks.empty()) {
+				return;
+			}
+			if (_route_through_lanes) {
+				for (Task & task : tasks) {
+					post(std::move(task));
+				}
+				return;
+			}
+#if PMCONCURRENCY_METRICS
+			for (Task & task : tasks) {
+				task = Task(meter(std::move(task)));
+			}
+#endif
+			if (_scheduler) {
+				_tracker.posted(tasks.size());
+				_scheduler->post_bulk(tasks);
+				return;
+			}
+			std::shared_ptr<detail::TaskBatch> batch = std::make_shared<detail::TaskBatch>(std::move(tasks));
+			size_t drainers = std::min(batch->size(), _thread_size);
+			for (size_t i = 0; i < drainers; ++i) {
+				postHandler([this, batch] () { drainBatch(batch); });
+			}
+		}
+
+		void drainBatch(const std::shared_ptr<detail::TaskBatch> & batch) {
+			try {
+				batch->drain();
+			}
+			catch (...) {
+				if (!batch->done()) {
+					postHandler([this, batch] () { drainBatch(batch); });
+				}
+				throw;
+			}
+		}
+
+		void postToLane(Task && task, Priority priority) {
+			_lanes.push(std::move(task), priority);
+			postBackend(Task([this] () { runLaneTask(); }));
+		}
+
+		void runLaneTask() {
+			Task task = _lanes.pop();
+			if (task) {
+				task();
+			}
+		}
+
+		void postBackend(Task && task) {
+#if PMCONCURRENCY_METRICS
+			postHandler(meter(std::move(task)));
+#else
+			postHandler(std::move(task));
+#endif
+		}
+
+		bool tryPostBackend(Task && task) {
+			if (!_scheduler) {
+				postBackend(std::move(task));
+				return true;
+			}
+#if PMCONCURRENCY_METRICS
+			Task handler(meter(std::move(task)));
+#else
+			Task handler(std::move(task));
+#endif
+			_tracker.posted();
+			if (_scheduler->try_post(handler)) {
+				return true;
+			}
+			_tracker.finished();
+#if PMCONCURRENCY_METRICS
+			_metrics->current().submitted.fetch_sub(1, std::memory_order_relaxed);
+#endif
+			return false;
+		}
+
+		void spawnWorker(size_t i) {
+			_active.fetch_add(1, std::memory_order_relaxed);
+			_worker_running[i].store(true, std::memory_order_relaxed);
+			_group[i] = std::thread([this, i] () {
+				detail::current_worker().pool = this;
+				detail::current_worker().index = i;
+				detail::pin_current_thread(_placements[i].cpus);
+#if PMCONCURRENCY_METRICS
+				_metrics->worker_started(i);
+				struct Stopped {
+					detail::MetricsRecorder & metrics;
+					std::size_t index;
+					~Stopped() {
+						metrics.worker_stopped(index);
+					}
+				} stopped = { *_metrics, i };
+#endif
+				// A throwing task unwinds the run loop; the worker reports it and
+				// goes back to work.
+				bool retired = false;
+				for (;;) {
+					try {
+						if (_scheduler) {
+							_scheduler->run(i, _spin, _elastic ? _retire_after : std::chrono::milliseconds(0),
+								[this, &retired] () { return retired = tryRetire(); });
+						}
+						else {
+							retired = runService(nodeService(_placements[i].node));
+						}
+						break;
+					}
+					catch(...) {
+						reportError(std::current_exception());
+					}
+				}
+				if (!retired) {
+					_active.fetch_sub(1, std::memory_order_relaxed);
+				}
+				_worker_running[i].store(false, std::memory_order_release);
+			});
+		}
+
+		// Returns true when the worker retired rather than saw the service stop.
+		bool runService(asio::io_service & service) {
+			if (!_elastic && _spin == 0) {
+				service.run();
+				return false;
+			}
+			for (;;) {
+				bool ran = false;
+				for (unsigned i = 0; i < _spin && !ran; ++i) {
+					ran = service.poll_one() != 0;
+					if (!ran) {
+						detail::cpu_relax();
+					}
+				}
+				if (ran) {
+					continue;
+				}
+				if (!_elastic) {
+					if (!service.run_one()) {
+						return false;
+					}
+				}
+				else if (!service.run_one_for(_retire_after)) {
+					if (service.stopped()) {
+						return false;
+					}
+					if (tryRetire()) {
+						return true;
+					}
+				}
+			}
+		}
+
+		void reportError(std::exception_ptr eptr) {
+			if (_on_error) {
+				_on_error(eptr);
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(_error_mutex);
+				if (!_eptr) {
+					_eptr = eptr;
+				}
+			}
+			_main_executor.post([eptr] () {
+				std::rethrow_exception(eptr);
+			});
+		}
+
+		// An idle elastic worker may exit while more than min_threads run.
+		bool tryRetire() {
+			size_t active = _active.load(std::memory_order_relaxed);
+			while (active > _min_threads) {
+				if (_active.compare_exchange_weak(active, active - 1, std::memory_order_relaxed)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		size_t pending() const {
+			return _scheduler ? _scheduler->pending() : _queued.load(std::memory_order_relaxed);
+		}
+
+		// Every grow_after, if work is queued, posts a probe task; a probe that
+		// has not started one grow_after later means queued work waits too
+		// long, so one more worker is started.
+		void supervise() {
+			std::unique_lock<std::mutex> lock(_elastic_mutex);
+			for (;;) {
+				_elastic_cv.wait_for(lock, _grow_after, [this] () { return !_supervising; });
+				if (!_supervising) {
+					return;
+				}
+				if (!_probe_pending.load(std::memory_order_acquire)) {
+					if (pending() != 0) {
+						_probe_pending.store(true, std::memory_order_relaxed);
+						_probe_posted = std::chrono::steady_clock::now();
+						postBackend(Task([this] () { _probe_pending.store(false, std::memory_order_release); }));
+					}
+				}
+				else if (std::chrono::steady_clock::now() - _probe_posted >= _grow_after) {
+					grow();
+				}
+			}
+		}
+
+		void grow() {
+			for (size_t i = 0; i < _thread_size; ++i) {
+				if (!_worker_running[i].load(std::memory_order_acquire)) {
+					if (_group[i].joinable()) {
+						_group[i].join();
+					}
+					spawnWorker(i);
+					return;
+				}
+			}
+		}
+
+		void stopSupervisor() {
+			{
+				std::lock_guard<std::mutex> lock(_elastic_mutex);
+				if (!_supervising) {
+					return;
+				}
+				_supervising = false;
+			}
+			_elastic_cv.notify_all();
+			_supervisor.join();
+		}
+
+		void postOnNode(Task && task, size_t node) {
+#if PMCONCURRENCY_METRICS
+			postHandlerOnNode(meter(std::move(task)), node);
+#else
+			postHandlerOnNode(std::move(task), node);
+#endif
+		}
+
+#if PMCONCURRENCY_METRICS
+		detail::MeteredTask meter(Task && task) {
+			_metrics->current().submitted.fetch_add(1, std::memory_order_relaxed);
+#if PMCONCURRENCY_TRACING
+			return detail::MeteredTask{ _metrics.get(), std::move(task), detail::now_ns(), _trace.get(),
+				TraceLabel::current() };
+#else
+			return detail::MeteredTask{ _metrics.get(), std::move(task), detail::now_ns() };
+#endif
+		}
+#endif
+
+		// Workers post to their own sub-pool, other threads round-robin.
+		template<typename Handler>
+		void postHandler(Handler && handler) {
+			if (_scheduler) {
+				_tracker.posted();
+				_scheduler->post(Task(std::forward<Handler>(handler)));
+			}
+			else if (_node_count == 1) {
+				postToService(_io_service, std::forward<Handler>(handler));
+			}
+			else {
+				size_t index = get_worker_index();
+				size_t node = index != no_worker ? _placements[index].node
+					: _next_node.fetch_add(1, std::memory_order_relaxed) % _node_count;
+				postToService(nodeService(node), std::forward<Handler>(handler));
+			}
+		}
+
+		template<typename Handler>
+		void postHandlerOnNode(Handler && handler, size_t node) {
+			if (_scheduler) {
+				_tracker.posted();
+				_scheduler->post_on_node(Task(std::forward<Handler>(handler)), node);
+			}
+			else {
+				postToService(nodeService(node), std::forward<Handler>(handler));
+			}
+		}
+
+		// Elastic pools also count what sits in the asio queues, for pending().
+		template<typename Handler>
+		void postToService(asio::io_service & service, Handler && handler) {
+			_tracker.posted();
+			if (_elastic) {
+				_queued.fetch_add(1, std::memory_order_relaxed);
+			}
+			asio::post(service, detail::TrackedHandler<typename std::decay<Handler>::type>{
+				&_tracker, _elastic ? &_queued : nullptr, std::forward<Handler>(handler) });
+		}
+
+		// Destroys what the queues hold once the workers have stopped. asio
+		// cannot hand its queue back, so it is run with every handler skipped.
+		// Destroying a task can queue another (a TaskGroup's on_complete, say),
+		// hence the loop.
+		void discardQueued() {
+			for (;;) {
+				std::size_t discarded = _lanes.clear();
+				if (_scheduler) {
+					discarded += _scheduler->discard();
+				}
+				else {
+					_tracker.set_discarding(true);
+					for (std::size_t node = 0; node < _node_count; ++node) {
+						asio::io_service & service = nodeService(node);
+						service.reset();
+						discarded += service.poll();
+					}
+					_tracker.set_discarding(false);
+				}
+				if (discarded == 0) {
+					return;
+				}
+			}
+		}
+
+		void joinWorkers() {
+			for (auto& thread : _group) {
+				if (thread.joinable()) {
+					thread.join();
+				}
+			}
+			_group.clear();
+		}
+
+		std::mutex _error_mutex;
+		std::exception_ptr _eptr;         //< for checkError()
+		size_t _thread_size;
+		SchedulerMode _mode;
+		CpuTopology _topology;
+		std::vector<detail::WorkerPlacement> _placements; //< one per worker
+		size_t _node_count;
+		std::atomic<size_t> _next_node;
+		detail::TaskTracker _tracker;     //< for wait_idle()
+		std::mutex _cancel_mutex;
+		CancellationSource _cancellation; //< cancelled by shutdown_now(), renewed by start()
+		detail::Admission _admission;     //< outlives the queues, whose tasks hold its slots
+		detail::TimerWheel _timers;       //< likewise, for periodic timers' runs
+		detail::PriorityLanes _lanes;
+		bool _route_through_lanes;
+		MainExecutor _main_executor;
+		asio::io_service _io_service; //< the io_service we are wrapping
+		std::vector<std::unique_ptr<asio::io_service>> _node_services; //< NUMA sub-pools 1.. in SchedulerMode::Asio
+		std::vector<std::unique_ptr<asio::io_service::work>> _work;
+		std::unique_ptr<detail::Scheduler> _scheduler; //< all modes but SchedulerMode::Asio
+		std::shared_ptr<SerialExecutor> _strand;       //< behind strand()
+		std::vector<std::thread> _group;  //< need to keep track of threads so we can join them
+		const bool _elastic;
+		const size_t _min_threads;        //< workers started by start(), and kept when elastic
+		const std::chrono::microseconds _grow_after;
+		const std::chrono::milliseconds _retire_after;
+		const unsigned _spin;
+		const std::function<void (std::exception_ptr)> _on_error;
+		std::atomic<size_t> _active;
+		std::atomic<size_t> _queued;      //< handlers in the asio queues, elastic pools only
+		std::unique_ptr<std::atomic<bool>[]> _worker_running; //< per slot in _group
+		std::mutex _elastic_mutex;
+		std::condition_variable _elastic_cv;
+		bool _supervising;
+		std::thread _supervisor;
+		std::atomic<bool> _probe_pending;
+		std::chrono::steady_clock::time_point _probe_posted;
+#if PMCONCURRENCY_METRICS
+		std::unique_ptr<detail::MetricsRecorder> _metrics;
+#endif
+#if PMCONCURRENCY_TRACING
+		std::unique_ptr<detail::TraceRecorder> _trace; //< null unless ThreadPoolOptions::trace_capacity
+#endif
+	};
+
+	// Runs the tasks given to it one at a time, in the order they were
+	// queued, on the workers of a pool. Producers push onto a lock-free MPSC
+	// list and a count of queued tasks doubles as the "running" flag: the
+	// push that raises it from zero posts a drain task, and the drain task
+	// runs until it brings it back down. After drain_batch tasks it yields
+	// its worker to other work and reposts itself.
+	class SerialExecutor : public std::enable_shared_from_this<SerialExecutor> {
+	public:
+		static const std::size_t drain_batch = 64;
+
+		// Use ThreadPool::make_serial_executor().
+		explicit SerialExecutor(ThreadPool & pool) : _pool(pool), _tail(new_node(Task())), _head(_tail), _queued(0) {}
+
+		SerialExecutor(const SerialExecutor &) = delete;
+		SerialExecutor & operator=(const SerialExecutor &) = delete;
+
+		~SerialExecutor() {
+			while (_tail) {
+				Node * next = _tail->next.load(std::memory_order_relaxed);
+				delete_node(_tail);
+				_tail = next;
+			}
+		}
+
+		template<typename T> // T must be "void handler()""
+		void enqueue(T && f) {
+			push(Task(std::forward<T>(f)));
+		}
+
+		template<typename F, typename... Args>
+		Future<detail::invoke_result_t<typename std::decay<F>::type, typename std::decay<Args>::type...>>
+		submit(F && f, Args &&... args) {
+			typedef detail::invoke_result_t<typename std::decay<F>::type, typename std::decay<Args>::type...> R;
+			static_assert(!std::is_reference<R>::value, "submit() does not support reference results");
+			typedef detail::TaskState<R, typename std::decay<F>::type, typename std::decay<Args>::type...> State;
+
+			State * state = State::create(std::forward<F>(f), std::forward<Args>(args)...);
+			state->set_helper(_pool.helper());
+			Future<R> future(state);
+			push(Task(detail::TaskRunner<State>(state)));
+			return future;
+		}
+
+		// True inside a task of this executor.
+		bool running_in_this_thread() const {
+			return current() == this;
+		}
+
+		ThreadPool & get_pool() const {
+			return _pool;
+		}
+
+	private:
+		struct Node {
+			explicit Node(Task && t) : next(nullptr), task(std::move(t)) {}
+			std::atomic<Node *> next;
+			Task task;
+		};
+
+		struct Current {
+			explicit Current(const SerialExecutor * executor) : saved(current()) {
+				current() = executor;
+			}
+			~Current() {
+				current() = saved;
+			}
+			const SerialExecutor * saved;
+		};
+
+		static const SerialExecutor *& current() {
+			static thread_local const SerialExecutor * executor = nullptr;
+			return executor;
+		}
+
+		static Node * new_node(Task && task) {
+			return new (detail::BlockCache::allocate(sizeof(Node))) Node(std::move(task));
+		}
+
+		static void delete_node(Node * node) {
+			node->~Node();
+			detail::BlockCache::deallocate(node, sizeof(Node));
+		}
+
+		void push(Task && task) {
+			Node * node = new_node(std::move(task));
+			Node * prev = _head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+			if (_queued.fetch_add(1, std::memory_order_acq_rel) == 0) {
+				schedule();
+			}
+		}
+
+		// The drain task. If the pool discards it unrun (ThreadPool::shutdown_now()),
+		// the tasks it would have run are discarded with it.
+		struct Drain {
+			explicit Drain(std::shared_ptr<SerialExecutor> && s) : self(std::move(s)) {}
+			Drain(Drain &&) = default;
+
+			~Drain() {
+				if (self) {
+					self->abandon();
+				}
+			}
+
+			void operator()() {
+				std::shared_ptr<SerialExecutor> executor(std::move(self));
+				executor->drain();
+			}
+
+			std::shared_ptr<SerialExecutor> self;
+		};
+
+		void schedule();
+
+		// _tail is a consumed node; the task to run is in its successor, which
+		// a counted push may not have linked yet.
+		Task pop() {
+			Node * next = _tail->next.load(std::memory_order_acquire);
+			while (!next) {
+				detail::cpu_relax();
+				next = _tail->next.load(std::memory_order_acquire);
+			}
+			Task task(std::move(next->task));
+			delete_node(_tail);
+			_tail = next;
+			return task;
+		}
+
+		// Returns true while tasks remain queued.
+		bool finish() {
+			return _queued.fetch_sub(1, std::memory_order_acq_rel) != 1;
+		}
+
+		void drain() {
+			Current scope(this);
+			for (std::size_t i = 0; i < drain_batch; ++i) {
+				Task task = pop();
+				try {
+					detail::ScratchArena::Scope scratch;
+					task();
+				}
+				catch (...) {
+					task.reset();
+					if (finish()) {
+						schedule();
+					}
+					throw;
+				}
+				task.reset();
+				if (!finish()) {
+					return;
+				}
+			}
+			schedule();
+		}
+
+		void abandon() {
+			do {
+				pop().reset();
+			} while (finish());
+		}
+
+		ThreadPool & _pool;
+		Node * _tail;                //< consumer side, touched by the drain task only
+		std::atomic<Node *> _head;   //< last pushed node
+		std::atomic<std::size_t> _queued;
+	};
+
+	namespace detail {
+		template<typename Index, typename Shared>
+		class ParallelLoop;
+	}
+
+	// Fan-out/fan-in over a ThreadPool. Each finished task costs one atomic
+	// decrement; the task that brings the count to zero runs the on_complete()
+	// continuation and wakes any wait()ers. A task the pool drops under
+	// max_in_flight counts as finished. The first exception thrown by a task
+	// is kept for wait().
+	class TaskGroup {
+	public:
+		explicit TaskGroup(ThreadPool & pool) : _pool(pool), _state(0), _epoch(0), _failed(false) {}
+
+		// Waits for outstanding tasks; a group must not die under its tasks.
+		// An error no wait() has seen is discarded.
+		~TaskGroup() {
+			join();
+		}
+
+		TaskGroup(const TaskGroup &) = delete;
+		TaskGroup & operator=(const TaskGroup &) = delete;
+
+		template<typename T> // T must be "void handler()""
+		void run(T && f) {
+			_state.fetch_add(1, std::memory_order_relaxed);
+			_pool.enqueue(Runner<typename std::decay<T>::type>(this, std::forward<T>(f)));
+		}
+
+		// Runs f once every task passed to run() so far has finished: on the
+		// worker that finished last, or enqueued if the group is already done.
+		// f should keep whatever owns the group alive until it runs.
+		template<typename T> // T must be "void handler()""
+		void on_complete(T && f) {
+			_continuation = Task(std::forward<T>(f));
+			std::uint64_t prev = _state.fetch_or(armed_flag, std::memory_order_acq_rel);
+			if ((prev & count_mask) == 0) {
+				_pool.post(takeContinuation());
+			}
+		}
+
+		// Returns once the group is done, rethrowing the first exception one
+		// of its tasks threw since the last wait(). The pool's queued tasks
+		// run on this thread meanwhile, so tasks may wait on nested groups.
+		void wait() {
+			join();
+			if (_failed.load(std::memory_order_acquire)) {
+				std::exception_ptr error;
+				error.swap(_error);
+				_failed.store(false, std::memory_order_relaxed);
+				std::rethrow_exception(error);
+			}
+		}
+
+		bool done() const {
+			return (_state.load(std::memory_order_acquire) & count_mask) == 0;
+		}
+
+	private:
+		template<typename Index, typename Shared>
+		friend class detail::ParallelLoop;
+
+		static const std::uint64_t count_mask = 0xFFFFFFFFull;
+		static const std::uint64_t armed_flag = 1ull << 32;
+		static const std::uint64_t waiting_flag = 1ull << 33;
+
+		// Runs the pool's queued tasks, the group's or not, until it is done.
+		void join() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			unsigned long epoch = _epoch;
+			std::uint64_t prev = _state.fetch_or(waiting_flag, std::memory_order_acq_rel);
+			if ((prev & count_mask) == 0) {
+				_state.fetch_and(~waiting_flag, std::memory_order_relaxed);
+				return;
+			}
+			while (_epoch == epoch) {
+				lock.unlock();
+				bool ran = _pool.run_pending_task();
+				lock.lock();
+				if (!ran) {
+					_cv.wait_for(lock, detail::Helper::idle_wait(), [this, epoch] () { return _epoch != epoch; });
+				}
+			}
+		}
+
+		void fail(std::exception_ptr eptr) {
+			std::lock_guard<std::mutex> lock(_error_mutex);
+			if (!_failed.load(std::memory_order_relaxed)) {
+				_error = eptr;
+				_failed.store(true, std::memory_order_release);
+			}
+		}
+
+		// Like run(), but never held back by max_in_flight; for the pieces of a
+		// parallel loop, none of which may be lost.
+		template<typename T>
+		void spawn(T && f) {
+			_state.fetch_add(1, std::memory_order_relaxed);
+			_pool.post(Task(Runner<typename std::decay<T>::type>(this, std::forward<T>(f))));
+		}
+
+		template<typename Fn>
+		struct Runner {
+			template<typename F>
+			Runner(TaskGroup * g, F && f) : group(g), fn(std::forward<F>(f)) {}
+
+			Runner(Runner && other) noexcept(std::is_nothrow_move_constructible<Fn>::value)
+				: group(other.group), fn(std::move(other.fn)) {
+				other.group = nullptr;
+			}
+
+			~Runner() {
+				if (group) {
+					group->finishOne();
+				}
+			}
+
+			void operator()() {
+				TaskGroup * g = group;
+				Finisher finisher(g);
+				group = nullptr;
+				try {
+					fn();
+				}
+				catch (...) {
+					g->fail(std::current_exception());
+				}
+			}
+
+			TaskGroup * group;
+			Fn fn;
+		};
+
+		struct Finisher {
+			explicit Finisher(TaskGroup * g) : group(g) {}
+			~Finisher() {
+				group->finishOne();
+			}
+			TaskGroup * group;
+		};
+
+		Task takeContinuation() {
+			Task continuation(std::move(_continuation));
+			_state.fetch_and(~armed_flag, std::memory_order_acq_rel);
+			return continuation;
+		}
+
+		// Nothing in the group is touched after the last wake-up unless a
+		// continuation, which keeps the group alive, is armed.
+		void finishOne() {
+			std::uint64_t prev = _state.fetch_sub(1, std::memory_order_acq_rel);
+			if ((prev & count_mask) != 1) {
+				return;
+			}
+			Task continuation;
+			if (prev & armed_flag) {
+				continuation = takeContinuation();
+			}
+			if (prev & waiting_flag) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_state.fetch_and(~waiting_flag, std::memory_order_relaxed);
+				++_epoch;
+				_cv.notify_all();
+			}
+			if (continuation) {
+				continuation();
+			}
+		}
+
+		ThreadPool & _pool;
+		std::atomic<std::uint64_t> _state; //< pending count | armed_flag | waiting_flag
+		Task _continuation;
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		unsigned long _epoch;
+		std::mutex _error_mutex;
+		std::atomic<bool> _failed;
+		std::exception_ptr _error;
+	};
+
+	// A DAG of tasks, built once and run any number of times. Each run resets
+	// every node's counter of unfinished predecessors; a finishing node
+	// decrements its successors' counters, queues all but one of those that
+	// become ready and runs the remaining one itself, on the same worker.
+	// After a node throws, the rest of that run is skipped and wait()
+	// rethrows the exception. The graph must not change while it runs.
+	class TaskGraph {
 	public:
-		MainIoService() {}
+		typedef std::size_t NodeId;
 
-		~MainIoService() {
-			_work.reset();
+		explicit TaskGraph(ThreadPool & pool) : _pool(pool), _dirty(false), _remaining(0), _running(false),
+			_failed(false) {}
+
+		// Waits for a run in progress.
+		~TaskGraph() {
+			join();
 		}
 
+		TaskGraph(const TaskGraph &) = delete;
+		TaskGraph & operator=(const TaskGraph &) = delete;
+
+		// f is called once per run.
 		template<typename T> // T must be "void handler()""
-		void enqueue(T f){
-			_io_service.post(f);
+		NodeId add(T && f) {
+			_nodes.emplace_back(new Node(Task(std::forward<T>(f))));
+			_dirty = true;
+			return _nodes.size() - 1;
 		}
 
-		void start() {
-			if(_io_service.stopped()) {
-				_io_service.reset();
+		// `after` starts only once `before` has finished.
+		void precede(NodeId before, NodeId after) {
+			_nodes.at(before)->successors.push_back(after);
+			++_nodes.at(after)->predecessors;
+			_dirty = true;
+		}
+
+		std::size_t size() const {
+			return _nodes.size();
+		}
+
+		// Starts a run; throws std::invalid_argument if the graph has a cycle.
+		void run_async() {
+			if (_dirty) {
+				validate();
+			}
+			if (_nodes.empty()) {
+				return;
+			}
+			for (auto & node : _nodes) {
+				node->pending.store(node->predecessors, std::memory_order_relaxed);
+			}
+			_failed.store(false, std::memory_order_relaxed);
+			_error = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_running = true;
+			}
+			_remaining.store(_nodes.size(), std::memory_order_release);
+			for (NodeId root : _roots) {
+				schedule(root);
 			}
-			_work.reset(new asio::io_service::work(_io_service));
-			_io_service.run();
 		}
 
-		void stop() {
-			if(_work) {
-				_work.reset();
+		// Waits for the current run, running the pool's queued tasks meanwhile,
+		// then rethrows the first exception one of its nodes threw.
+		void wait() {
+			join();
+			if (_failed.load(std::memory_order_acquire)) {
+				std::exception_ptr error;
+				error.swap(_error);
+				_failed.store(false, std::memory_order_relaxed);
+				std::rethrow_exception(error);
 			}
+		}
+
+		void run() {
+			run_async();
+			wait();
+		}
 
+		bool done() const {
+			return _remaining.load(std::memory_order_acquire) == 0;
 		}
 
 	private:
-		asio::io_service _io_service;
-		std::unique_ptr<asio::io_service::work> _work;
-	};
+		struct Node {
+			explicit Node(Task && t) : work(std::move(t)), predecessors(0), pending(0) {}
+			Task work;
+			std::vector<NodeId> successors;
+			std::size_t predecessors;
+			std::atomic<std::size_t> pending; //< predecessors yet to finish in this run
+		};
+
+		// Finds the roots, and with Kahn's algorithm checks that every node
+		// is reachable from them, which fails exactly when there is a cycle.
+		void validate() {
+			std::vector<std::size_t> in_degree(_nodes.size());
+			std::vector<NodeId> ready;
+			_roots.clear();
+			for (NodeId id = 0; id < _nodes.size(); ++id) {
+				in_degree[id] = _nodes[id]->predecessors;
+				if (in_degree[id] == 0) {
+					_roots.push_back(id);
+					ready.push_back(id);
+				}
+			}
+			std::size_t visited = 0;
+			while (!ready.empty()) {
+				NodeId id = ready.back();
+				ready.pop_back();
+				++visited;
+				for (NodeId next : _nodes[id]->successors) {
+					if (--in_degree[next] == 0) {
+						ready.push_back(next);
+					}
+				}
+			}
+			if (visited != _nodes.size()) {
+				throw std::invalid_argument("TaskGraph has a cycle");
+			}
+			_dirty = false;
+		}
+
+		// A node's task. One the pool discards unrun (ThreadPool::shutdown_now())
+		// fails the run with broken_promise.
+		struct Step {
+			Step(TaskGraph * g, NodeId n) : graph(g), id(n) {}
+
+			Step(Step && other) noexcept : graph(other.graph), id(other.id) {
+				other.graph = nullptr;
+			}
+
+			~Step() {
+				if (graph) {
+					graph->abandon(id);
+				}
+			}
+
+			void operator()() {
+				TaskGraph * g = graph;
+				graph = nullptr;
+				g->execute(id);
+			}
+
+			TaskGraph * graph;
+			NodeId id;
+		};
+
+		void schedule(NodeId id) {
+			_pool.post(Task(Step(this, id)));
+		}
+
+		void execute(NodeId id) {
+			for (;;) {
+				Node & node = *_nodes[id];
+				if (!_failed.load(std::memory_order_relaxed)) {
+					try {
+						detail::ScratchArena::Scope scratch;
+						node.work();
+					}
+					catch (...) {
+						fail(std::current_exception());
+					}
+				}
+				NodeId next = no_node;
+				for (NodeId successor : node.successors) {
+					if (_nodes[successor]->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+						if (next != no_node) {
+							schedule(next);
+						}
+						next = successor;
+					}
+				}
+				finishOne();
+				if (next == no_node) {
+					return;
+				}
+				id = next;
+			}
+		}
+
+		void fail(std::exception_ptr eptr) {
+			std::lock_guard<std::mutex> lock(_error_mutex);
+			if (!_failed.load(std::memory_order_relaxed)) {
+				_error = eptr;
+				_failed.store(true, std::memory_order_release);
+			}
+		}
+
+		// Finishes id and everything it leads to here, without posting, since
+		// the pool is shutting down.
+		void abandon(NodeId id) {
+			fail(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+			std::vector<NodeId> ready(1, id);
+			while (!ready.empty()) {
+				Node & node = *_nodes[ready.back()];
+				ready.pop_back();
+				for (NodeId successor : node.successors) {
+					if (_nodes[successor]->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+						ready.push_back(successor);
+					}
+				}
+				finishOne();
+			}
+		}
+
+		// Nothing in the graph is touched after the last node's wake-up.
+		void finishOne() {
+			if (_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_running = false;
+				_cv.notify_all();
+			}
+		}
+
+		void join() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			while (_running) {
+				lock.unlock();
+				bool ran = _pool.run_pending_task();
+				lock.lock();
+				if (!ran) {
+					_cv.wait_for(lock, detail::Helper::idle_wait(), [this] () { return !_running; });
+				}
+			}
+		}
 
+		static const NodeId no_node = static_cast<NodeId>(-1);
 
-	class ThreadPool {
+		ThreadPool & _pool;
+		std::vector<std::unique_ptr<Node>> _nodes;
+		std::vector<NodeId> _roots;
+		bool _dirty;                      //< nodes or edges added since validate()
+		std::atomic<std::size_t> _remaining; //< nodes yet to finish in this run
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		bool _running;
+		std::mutex _error_mutex;
+		std::atomic<bool> _failed;
+		std::exception_ptr _error;
+	};
+
+	// One cache-line aligned T per worker of a pool, so that workers updating
+	// their own slot never share a line. Threads that are not workers of the
+	// pool (such as a caller helping in parallel_for) get slots created on
+	// demand behind a mutex. combine() folds every slot, starting from init.
+	template<typename T>
+	class PerWorker {
 	public:
-		ThreadPool(size_t threads = std::thread::hardware_concurrency() - 1) 
-			:  _thread_size(threads), _strand(_io_service) {
+		explicit PerWorker(ThreadPool & pool, const T & init = T())
+			: _pool(pool), _init(init), _size(pool.get_thread_size()),
+			_stride((sizeof(T) + detail::cache_line_size - 1) / detail::cache_line_size * detail::cache_line_size),
+			_storage(new unsigned char[_size * _stride + detail::cache_line_size]) {
+			std::uintptr_t base = reinterpret_cast<std::uintptr_t>(_storage.get());
+			_slots = reinterpret_cast<unsigned char *>(
+				(base + detail::cache_line_size - 1) & ~(static_cast<std::uintptr_t>(detail::cache_line_size) - 1));
+			std::size_t i = 0;
+			try {
+				for (; i < _size; ++i) {
+					new (_slots + i * _stride) T(_init);
+				}
+			}
+			catch (...) {
+				while (i > 0) {
+					slot(--i).~T();
+				}
+				throw;
+			}
 		}
 
-		~ThreadPool() {
-			_work.reset(); //stop all, allow run() to exit
-			
-			for (auto& thread : _group) {
-      			if (thread.joinable()) {
-      				thread.join();
-      			}
-  			}
+		~PerWorker() {
+			for (std::size_t i = 0; i < _size; ++i) {
+				slot(i).~T();
+			}
 		}
 
-		template<typename T> // T must be "void handler()""
-		void enqueue(T f) {
-			_io_service.post(f);
+		PerWorker(const PerWorker &) = delete;
+		PerWorker & operator=(const PerWorker &) = delete;
+
+		T & local() {
+			std::size_t index = _pool.get_worker_index();
+			if (index < _size) {
+				return slot(index);
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			std::thread::id id = std::this_thread::get_id();
+			for (auto & extra : _extra) {
+				if (extra.first == id) {
+					return extra.second->value;
+				}
+			}
+			_extra.emplace_back(id, std::unique_ptr<Padded>(new Padded(_init)));
+			return _extra.back().second->value;
 		}
-		
-		template<typename T> // T must be "void handler()""
-		void strand(T f) {
-			_io_service.post(_strand.wrap(f));
+
+		// Only meaningful once the workers have stopped touching their slots.
+		template<typename F>
+		void combine_each(F f) {
+			for (std::size_t i = 0; i < _size; ++i) {
+				f(slot(i));
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (auto & extra : _extra) {
+				f(extra.second->value);
+			}
 		}
 
-		asio::io_service & get_io_service() {
-			return _io_service;
+		template<typename Combine>
+		T combine(Combine op) {
+			T result = _init;
+			combine_each([&result, &op] (T & value) {
+				result = op(std::move(result), value);
+			});
+			return result;
 		}
-		
-		size_t get_thread_size() {
-			return _thread_size;
+
+		void clear() {
+			combine_each([this] (T & value) {
+				value = _init;
+			});
 		}
 
-		void start() {
-			if(_io_service.stopped()) {
-				_io_service.reset();
+	private:
+		struct Padded {
+			explicit Padded(const T & v) : value(v) {}
+			T value;
+			char pad[detail::cache_line_size];
+		};
+
+		T & slot(std::size_t i) {
+			return *reinterpret_cast<T *>(_slots + i * _stride);
+		}
+
+		ThreadPool & _pool;
+		const T _init;
+		const std::size_t _size;
+		const std::size_t _stride;
+		std::unique_ptr<unsigned char[]> _storage;
+		unsigned char * _slots;
+		std::mutex _mutex;
+		std::vector<std::pair<std::thread::id, std::unique_ptr<Padded>>> _extra;
+	};
+
+	namespace detail {
+
+		// Shared by every piece of one parallel_for/parallel_reduce. A piece
+		// splits off its upper half only while no previously split piece is still
+		// waiting to be picked up (lazy binary splitting), and the chunk size is
+		// doubled or halved to keep each body call near chunk_target.
+		template<typename Index, typename Shared>
+		class ParallelLoop {
+		public:
+			ParallelLoop(ThreadPool & pool, Shared & shared, std::size_t min_grain)
+				: _group(pool), _shared(shared), _min_grain(min_grain ? min_grain : 1),
+				_grain(_min_grain), _unstarted(0), _failed(false) {
 			}
-			_work.reset(new asio::io_service::work(_io_service));
-			for ( std::size_t i = 0; i < _thread_size; ++i ) {
-				_group.emplace_back( [this] () {
+
+			void process(Index begin, Index end) {
+				typename Shared::Piece piece = _shared.make_piece(begin);
+				while (begin < end) {
+					if (_failed.load(std::memory_order_relaxed)) {
+						return;
+					}
+					std::size_t size = static_cast<std::size_t>(end - begin);
+					std::size_t grain = _grain.load(std::memory_order_relaxed);
+					if (size > grain && _unstarted.load(std::memory_order_relaxed) == 0) {
+						Index middle = begin + static_cast<Index>(size / 2);
+						spawn(middle, end);
+						end = middle;
+						continue;
+					}
+					Index last = size > grain ? begin + static_cast<Index>(grain) : end;
+					std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 					try {
-						_io_service.run();
+						piece(begin, last);
 					}
-					catch(...) {
-						_eptr = std::current_exception();
-						_main_io_service.enqueue([this] () {
-							std::rethrow_exception(_eptr);
-						});
+					catch (...) {
+						fail(std::current_exception());
+						return;
 					}
+					adapt(grain, std::chrono::steady_clock::now() - start);
+					begin = last;
+				}
+				piece.finish();
+			}
+
+			void wait() {
+				_group.wait();
+				if (_error) {
+					std::rethrow_exception(_error);
+				}
+				// A split the pool discarded unrun (ThreadPool::shutdown_now()) left its range undone.
+				if (_unstarted.load(std::memory_order_relaxed) != 0) {
+					throw std::future_error(std::future_errc::broken_promise);
+				}
+			}
+
+		private:
+			static std::chrono::microseconds chunk_target() {
+				return std::chrono::microseconds(100);
+			}
+
+			void spawn(Index begin, Index end) {
+				_unstarted.fetch_add(1, std::memory_order_relaxed);
+				_group.spawn([this, begin, end] () {
+					_unstarted.fetch_sub(1, std::memory_order_relaxed);
+					process(begin, end);
 				});
-			}			
-		}
+			}
 
-		void stop() {
-			if(_work) {
-				_work.reset();	
+			void adapt(std::size_t grain, std::chrono::steady_clock::duration elapsed) {
+				if (elapsed < chunk_target() / 2) {
+					_grain.store(grain * 2, std::memory_order_relaxed);
+				}
+				else if (elapsed > chunk_target() * 2 && grain > _min_grain) {
+					_grain.store(std::max(grain / 2, _min_grain), std::memory_order_relaxed);
+				}
 			}
-			
-			for (auto& thread : _group) {
-				if (thread.joinable()) {
-					thread.join();
+
+			void fail(std::exception_ptr eptr) {
+				if (!_failed.exchange(true, std::memory_order_acq_rel)) {
+					_error = eptr;
 				}
 			}
 
-			_group.clear();
+			TaskGroup _group;
+			Shared & _shared;
+			const std::size_t _min_grain;
+			std::atomic<std::size_t> _grain;
+			std::atomic<std::size_t> _unstarted;
+			std::atomic<bool> _failed;
+			std::exception_ptr _error;
+		};
+
+		template<typename Index, typename Body>
+		struct ForShared {
+			struct Piece {
+				void operator()(Index first, Index last) {
+					body(first, last);
+				}
+				void finish() {}
+				Body & body;
+			};
+
+			Piece make_piece(Index) {
+				return Piece{ body };
+			}
+
+			Body & body;
+		};
+
+		// Each piece folds its contiguous sub-range; pieces are combined in
+		// index order, so combine only has to be associative.
+		template<typename Index, typename T, typename Body, typename Combine>
+		struct ReduceShared {
+			struct Piece {
+				void operator()(Index first, Index last) {
+					acc = shared.body(first, last, std::move(acc));
+				}
+				void finish() {
+					std::lock_guard<std::mutex> lock(shared.mutex);
+					shared.partials.emplace_back(begin, std::move(acc));
+				}
+				ReduceShared & shared;
+				Index begin;
+				T acc;
+			};
+
+			Piece make_piece(Index begin) {
+				return Piece{ *this, begin, identity };
+			}
+
+			ReduceShared(Body & b, Combine & c, const T & i) : body(b), combine(c), identity(i) {}
+
+			T result() {
+				std::sort(partials.begin(), partials.end(),
+					[] (const std::pair<Index, T> & a, const std::pair<Index, T> & b) { return a.first < b.first; });
+				T value = identity;
+				for (auto & partial : partials) {
+					value = combine(std::move(value), std::move(partial.second));
+				}
+				return value;
+			}
+
+			Body & body;
+			Combine & combine;
+			const T & identity;
+			std::mutex mutex;
+			std::vector<std::pair<Index, T>> partials;
+		};
+
+	}
+
+	inline void SerialExecutor::schedule() {
+		_pool.post(Task(Drain(shared_from_this())));
+	}
+
+	inline std::shared_ptr<SerialExecutor> ThreadPool::make_serial_executor() {
+		return std::make_shared<SerialExecutor>(*this);
+	}
+
+	template<typename T>
+	void ThreadPool::strand(T && f) {
+		_strand->enqueue(std::forward<T>(f));
+	}
+
+	template<typename Index, typename Body>
+	void ThreadPool::parallel_for(Index begin, Index end, Body body, std::size_t min_grain) {
+		if (!(begin < end)) {
+			return;
+		}
+		detail::ForShared<Index, Body> shared{ body };
+		detail::ParallelLoop<Index, detail::ForShared<Index, Body>> loop(*this, shared, min_grain);
+		loop.process(begin, end);
+		loop.wait();
+	}
+
+	template<typename Index, typename T, typename Body, typename Combine>
+	T ThreadPool::parallel_reduce(Index begin, Index end, T identity, Body body, Combine combine,
+		std::size_t min_grain) {
+		if (!(begin < end)) {
+			return identity;
 		}
+		detail::ReduceShared<Index, T, Body, Combine> shared(body, combine, identity);
+		detail::ParallelLoop<Index, detail::ReduceShared<Index, T, Body, Combine>> loop(*this, shared, min_grain);
+		loop.process(begin, end);
+		loop.wait();
+		return shared.result();
+	}
+
+#if PMCONCURRENCY_HAS_COROUTINES
+
+	template<typename T = void>
+	class task;
+
+	namespace detail {
+
+		// Coroutine frames come from the block cache; ones over
+		// BlockCache::max_block_size use the heap.
+		struct FrameAllocator {
+			static void * allocate(std::size_t size) {
+				return BlockCache::allocate(size);
+			}
+
+			static void deallocate(void * p, std::size_t size) {
+				BlockCache::deallocate(p, size);
+			}
+		};
+
+		// Told when a task without an awaiting coroutine finishes; returns the
+		// coroutine to transfer to.
+		class TaskListener {
+		public:
+			virtual std::coroutine_handle<> finished() noexcept = 0;
+
+		protected:
+			~TaskListener() {}
+		};
+
+		class TaskPromiseBase {
+		public:
+			struct FinalAwaiter {
+				bool await_ready() const noexcept {
+					return false;
+				}
+
+				template<typename Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+					TaskPromiseBase & promise = handle.promise();
+					if (promise._continuation) {
+						return promise._continuation;
+					}
+					if (promise._listener) {
+						return promise._listener->finished();
+					}
+					return std::noop_coroutine();
+				}
+
+				void await_resume() const noexcept {}
+			};
+
+			std::suspend_always initial_suspend() const noexcept {
+				return {};
+			}
+
+			FinalAwaiter final_suspend() const noexcept {
+				return {};
+			}
+
+			void unhandled_exception() noexcept {
+				_exception = std::current_exception();
+			}
+
+			static void * operator new(std::size_t size) {
+				return FrameAllocator::allocate(size);
+			}
+
+			static void operator delete(void * p, std::size_t size) {
+				FrameAllocator::deallocate(p, size);
+			}
+
+			void set_continuation(std::coroutine_handle<> continuation) noexcept {
+				_continuation = continuation;
+			}
+
+			void set_listener(TaskListener * listener) noexcept {
+				_listener = listener;
+			}
+
+		protected:
+			void rethrow() {
+				if (_exception) {
+					std::rethrow_exception(_exception);
+				}
+			}
+
+		private:
+			std::coroutine_handle<> _continuation;
+			TaskListener * _listener = nullptr;
+			std::exception_ptr _exception;
+		};
+
+		template<typename T>
+		class TaskPromise : public TaskPromiseBase {
+		public:
+			task<T> get_return_object() noexcept;
+
+			template<typename U>
+			void return_value(U && value) {
+				_value.emplace(std::forward<U>(value));
+			}
+
+			T result() {
+				rethrow();
+				return std::move(*_value);
+			}
+
+		private:
+			std::optional<T> _value;
+		};
+
+		template<>
+		class TaskPromise<void> : public TaskPromiseBase {
+		public:
+			task<void> get_return_object() noexcept;
+
+			void return_void() noexcept {}
+
+			void result() {
+				rethrow();
+			}
+		};
 
 		template<typename T>
-		void enqueueMainIoService(T f) {
-			_main_io_service.enqueue(f);
+		using when_all_value_t = typename std::conditional<std::is_void<T>::value, std::monostate, T>::type;
+
+	}
+
+	// A lazily started coroutine. co_await starts it and the awaiting coroutine
+	// is resumed by symmetric transfer when it finishes, on whatever thread
+	// finished it. Use co_await pool.schedule() inside to move onto the pool.
+	template<typename T>
+	class task {
+	public:
+		typedef detail::TaskPromise<T> promise_type;
+		typedef std::coroutine_handle<promise_type> handle_type;
+
+		task() noexcept {}
+
+		explicit task(handle_type handle) noexcept : _handle(handle) {}
+
+		task(task && other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+
+		task & operator=(task && other) noexcept {
+			if (this != &other) {
+				reset();
+				_handle = std::exchange(other._handle, nullptr);
+			}
+			return *this;
 		}
 
-		void startMainIoService() {
-			_main_io_service.start();
+		~task() {
+			reset();
 		}
 
-		void stopMainIoService() {
-			_main_io_service.stop();
+		bool valid() const noexcept {
+			return static_cast<bool>(_handle);
 		}
 
-		std::string getThisThreadId() {
-    		std::ostringstream ss;
-    		ss << std::this_thread::get_id();
-    		return ss.str();
+		auto operator co_await() && noexcept {
+			struct Awaiter {
+				handle_type handle;
+
+				bool await_ready() const noexcept {
+					return handle.done();
+				}
+
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+					handle.promise().set_continuation(awaiting);
+					return handle;
+				}
+
+				T await_resume() {
+					return handle.promise().result();
+				}
+			};
+			return Awaiter{ _handle };
 		}
 
-		void checkError() {
-			if(_eptr) {
-				std::rethrow_exception(_eptr);
-			}
+		// For when_all()/sync_wait(): starts the task, reporting to `listener`.
+		void start(detail::TaskListener & listener) {
+			_handle.promise().set_listener(&listener);
+			_handle.resume();
 		}
 
+		T result() {
+			return _handle.promise().result();
+		}
 
 	private:
-		
-		std::exception_ptr _eptr;
-		size_t _thread_size;
-		MainIoService _main_io_service;
-		asio::io_service _io_service; //< the io_service we are wrapping
-		std::unique_ptr<asio::io_service::work> _work;
-		asio::io_service::strand _strand;
-		std::vector<std::thread> _group;  //< need to keep track of threads so we can join them
+		void reset() noexcept {
+			if (_handle) {
+				_handle.destroy();
+				_handle = nullptr;
+			}
+		}
+
+		handle_type _handle;
 	};
 
+	namespace detail {
+
+		template<typename T>
+		task<T> TaskPromise<T>::get_return_object() noexcept {
+			return task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+		}
+
+		inline task<void> TaskPromise<void>::get_return_object() noexcept {
+			return task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+		}
+
+		class SyncWaitListener : public TaskListener {
+		public:
+			std::coroutine_handle<> finished() noexcept override {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_done = true;
+				_cv.notify_one();
+				return std::noop_coroutine();
+			}
+
+			void wait() {
+				std::unique_lock<std::mutex> lock(_mutex);
+				_cv.wait(lock, [this] () { return _done; });
+			}
+
+		private:
+			std::mutex _mutex;
+			std::condition_variable _cv;
+			bool _done = false;
+		};
+
+		// Starts every task and resumes the awaiting coroutine once all have
+		// finished; the extra count keeps the last task from resuming it while
+		// the others are still being started.
+		template<typename Start>
+		class WhenAllAwaiter : public TaskListener {
+		public:
+			WhenAllAwaiter(std::size_t count, Start start) : _pending(count + 1), _start(std::move(start)) {}
+
+			bool await_ready() const noexcept {
+				return _pending.load(std::memory_order_relaxed) == 1;
+			}
+
+			bool await_suspend(std::coroutine_handle<> awaiting) {
+				_awaiting = awaiting;
+				_start(*this);
+				return _pending.fetch_sub(1, std::memory_order_acq_rel) != 1;
+			}
+
+			void await_resume() const noexcept {}
+
+			std::coroutine_handle<> finished() noexcept override {
+				if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					return _awaiting;
+				}
+				return std::noop_coroutine();
+			}
+
+		private:
+			std::atomic<std::size_t> _pending;
+			std::coroutine_handle<> _awaiting;
+			Start _start;
+		};
+
+		template<typename Start>
+		WhenAllAwaiter<Start> when_all_awaiter(std::size_t count, Start start) {
+			return WhenAllAwaiter<Start>(count, std::move(start));
+		}
+
+	}
+
+	// Runs t to completion, blocking the calling thread, and returns its result.
+	// Must not be called from a worker that t needs in order to finish.
+	template<typename T>
+	T sync_wait(task<T> t) {
+		detail::SyncWaitListener listener;
+		t.start(listener);
+		listener.wait();
+		return t.result();
+	}
+
+	// Runs all tasks concurrently and resumes with their results in order; the
+	// first exception, in task order, is rethrown once every task has finished.
+	template<typename T>
+	task<std::vector<T>> when_all(std::vector<task<T>> tasks) {
+		co_await detail::when_all_awaiter(tasks.size(), [&tasks] (detail::TaskListener & listener) {
+			for (auto & t : tasks) {
+				t.start(listener);
+			}
+		});
+		std::vector<T> results;
+		results.reserve(tasks.size());
+		for (auto & t : tasks) {
+			results.push_back(t.result());
+		}
+		co_return results;
+	}
+
+	inline task<void> when_all(std::vector<task<void>> tasks) {
+		co_await detail::when_all_awaiter(tasks.size(), [&tasks] (detail::TaskListener & listener) {
+			for (auto & t : tasks) {
+				t.start(listener);
+			}
+		});
+		for (auto & t : tasks) {
+			t.result();
+		}
+	}
+
+	// As above for tasks of different types; void tasks yield std::monostate.
+	template<typename... Ts>
+	task<std::tuple<detail::when_all_value_t<Ts>...>> when_all(task<Ts>... tasks) {
+		co_await detail::when_all_awaiter(sizeof...(Ts), [&] (detail::TaskListener & listener) {
+			(tasks.start(listener), ...);
+		});
+		auto value = [] <typename T> (task<T> & t) -> detail::when_all_value_t<T> {
+			if constexpr (std::is_void<T>::value) {
+				t.result();
+				return std::monostate();
+			}
+			else {
+				return t.result();
+			}
+		};
+		co_return std::tuple<detail::when_all_value_t<Ts>...>{ value(tasks)... };
+	}
 
+#endif
 
 }
 